@@ -0,0 +1,89 @@
+/*
+
+  MyFS allocator microbenchmark
+
+  Times one data block allocation (find + free) on an image whose bitmap
+  is filled from the front to a given percentage, next to the old bit by
+  bit walk for comparison. The image is 4GB unless a size in MB is given.
+
+  gcc -O2 -Wall bench.c -o bench && ./bench [size in MB]
+
+*/
+
+#include "implementation.c"
+
+#define BENCH_FS_SIZE ((size_t)4096 << 20)
+#define BENCH_ROUNDS 20000
+#define BENCH_WALK_ROUNDS 200
+
+/**
+ * Old allocator, one bit at a time with a divide and modulo per block
+ */
+static size_t bit_walk(void *fsptr, size_t fssize, fs_context *ctx) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    unsigned char *bitmap = (unsigned char*)offset_to_ptr(fsptr, fssize, info_block->free_block_bitmap);
+    for (size_t block_num = 0; block_num < info_block->max_data_blocks; block_num++) {
+        if (!(bitmap[block_num / 8] & (1 << (block_num % 8)))) {
+            bitmap[block_num / 8] |= (1 << (block_num % 8));
+            return info_block->data_blocks + block_num * BLOCK_SIZE;
+        }
+    }
+    return (size_t)-1;
+}
+
+/**
+ * Nanoseconds per allocate + free pair
+ */
+static double time_alloc(void *fsptr, size_t fssize, fs_context *ctx, size_t (*alloc)(void*, size_t, fs_context*), int rounds) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < rounds; i++) {
+        size_t block_offset = alloc(fsptr, fssize, ctx);
+        if (block_offset == (size_t)-1) return -1;
+        free_data_block(fsptr, fssize, ctx, block_offset);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / rounds;
+}
+
+int main(int argc, char *argv[]) {
+    static const double fills[] = {0, 25, 50, 75, 90, 99, 99.9};
+    size_t fssize = argc > 1 ? strtoull(argv[1], NULL, 10) << 20 : BENCH_FS_SIZE;
+    void *fsptr = calloc(1, fssize);
+    fs_context *ctx;
+    int err;
+    if (!fsptr || __myfs_mount_implem(fsptr, fssize, &ctx, &err)) {
+        fprintf(stderr, "bench: could not make an image\n");
+        return 1;
+    }
+
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    size_t max_data_blocks = info_block->max_data_blocks;
+
+    printf("%zu data blocks, avx2 %s\n", max_data_blocks,
+#ifdef HAVE_AVX2_SCAN
+        __builtin_cpu_supports("avx2") ? "yes" : "no"
+#else
+        "no"
+#endif
+    );
+    printf("%8s %14s %14s\n", "fill %", "allocator ns", "bit walk ns");
+
+    for (size_t i = 0; i < sizeof(fills) / sizeof(fills[0]); i++) {
+        /*Fill the bitmap from the front, like first fit does, through the
+          allocator so the summary levels follow*/
+        size_t used = (size_t)(max_data_blocks * fills[i] / 100);
+        for (size_t b = 0; b < max_data_blocks; b++) {
+            if (b < used) claim_data_block(fsptr, fssize, ctx, b);
+            else free_data_block(fsptr, fssize, ctx, info_block->data_blocks + b * BLOCK_SIZE);
+        }
+
+        printf("%8.1f %14.1f %14.1f\n", fills[i],
+            time_alloc(fsptr, fssize, ctx, find_free_data_block, BENCH_ROUNDS),
+            time_alloc(fsptr, fssize, ctx, bit_walk, BENCH_WALK_ROUNDS));
+    }
+
+    __myfs_unmount_implem(fsptr, fssize, ctx, &err);
+    free(fsptr);
+    return 0;
+}
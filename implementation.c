@@ -39,6 +39,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1
+#endif
 
 
 /* The filesystem you implement must support all the 13 operations
@@ -238,28 +244,61 @@
 /**************Definitions**************/
 
 #define FS_ID 0x4D595346
+#define FS_VERSION 15
 #define BLOCK_SIZE 4096
 #define INODE_SIZE 128
 #define MAX_FILENAME 255
-#define MAX_INODES 1024
+#define BYTES_PER_INODE 16384
+#define MIN_INODES 16
 #define ROOT_INODE 0
-#define MAX_DATA_BLOCKS 2528 
+#define ROOT_INO 1
+#define INLINE_EXTENTS 4
+#define SUMMARY_LEVELS 2
+#define LOCK_STRIPES 64
+#define DCACHE_WAYS 8
+#define DCACHE_STRIPES 64
+#define DCACHE_MAX_SETS 4096
+#define INODES_PER_DCACHE_ENTRY 2
+#define DCACHE_NAME_MAX 98
+#define ATIME_ALWAYS 0
+#define ATIME_RELATIME 1
+#define ATIME_NEVER 2
+#define RELATIME_INTERVAL (24 * 60 * 60)
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_TX_MAGIC 0x4A545831
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 1024
+#define INODES_PER_JOURNAL_BLOCK 16
+#define JOURNAL_RANGE 1
+#define JOURNAL_BLOCK_BITS 2
+#define JOURNAL_INODE_BITS 3
+#define JOURNAL_REINDEX 4
 
 /**************Structs adn typedefs**************/
 
 /*
 *   Main info block of file system
 *       - fs_id: file system id (to check if fs is initialized)
+*       - version: on-image layout version, images of any other are refused
 *       - size: size of file system
 *       - root_inode: offset to root inode
 *       - free_inode_bitmap: offset to inode bitmap
 *       - free_block_bitmap: offset to data block bitmap
 *       - inode_table: offset to inode table
-*       - data_blocks: offset to data blocks
+*       - data_blocks: offset to data blocks (block aligned)
 *       - max_data_blocks: maximum number of data blocks
+*       - max_inodes: number of inodes in the inode table
+*       - block_summary: offsets to the summary levels of the data block bitmap
+*       - free_blocks: number of free data blocks
+*       - free_inodes: number of free inodes
+*       - journal: offset to the journal (block aligned, see journal_header)
+*       - journal_blocks: blocks taken by the journal, its header's included
+*       - clean: set by an unmount that left everything to sync to the
+*         caller, cleared while mounted
 */
 typedef struct{
     uint32_t fs_id;
+    uint32_t version;
     size_t size;
     size_t root_inode;
     size_t free_inode_bitmap;
@@ -267,8 +306,150 @@ typedef struct{
     size_t inode_table;
     size_t data_blocks;
     size_t max_data_blocks;
+    size_t max_inodes;
+    size_t block_summary[SUMMARY_LEVELS];
+    size_t free_blocks;
+    size_t free_inodes;
+    size_t journal;
+    size_t journal_blocks;
+    uint32_t clean;
 }fs_info_block;
 
+/*
+*   Callback writing a range of the image back to stable storage
+*       - arg: the caller's state
+*       - offset: start of the range, a multiple of BLOCK_SIZE
+*       - len: length of the range, whole blocks but clipped to the image
+*   Returns 0 on success, -1 on failure
+*/
+typedef int (*sync_callback)(void *arg, size_t offset, size_t len);
+
+/*
+*   Cached directory lookup, remembering which inode a directory's entry
+*   points to, or that the directory has no such entry. The cache is on the
+*   heap and starts out empty on every mount. It is DCACHE_WAYS-way set
+*   associative, each set evicting its least recently used entry.
+*       - dir_offset: offset to the directory inode (0 for a free entry)
+*       - inode_offset: offset to the inode the entry points to, 0 for a
+*         name the directory does not have
+*       - dir_generation: generation of the directory, entries of a freed
+*         directory never match the one reusing its inode
+*       - hash: hash of the name
+*       - last_used: tick of the set's stripe at the last hit
+*       - name_len: length of the name, longer names than DCACHE_NAME_MAX
+*         are not cached
+*       - name: name of the entry, '\0' terminated
+*/
+typedef struct{
+    size_t dir_offset;
+    size_t inode_offset;
+    uint32_t dir_generation;
+    uint32_t hash;
+    uint32_t last_used;
+    uint8_t name_len;
+    char name[DCACHE_NAME_MAX + 1];
+}dcache_entry;
+
+_Static_assert(sizeof(dcache_entry) == 128, "dentry cache entries take two cache lines");
+
+/*
+*   Lock and counters of a stripe of the dentry cache's sets
+*       - lock: guards the entries of the stripe's sets and the fields below
+*       - tick: clock of the stripe, advanced by every hit and insert
+*       - hits, negative_hits, misses: lookups answered by the cache, those
+*         answered with a missing name, and those that searched the directory
+*/
+typedef struct{
+    pthread_mutex_t lock;
+    uint32_t tick;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+}dcache_stripe;
+
+/*
+*   Locks and settings of a mount, allocated on the heap by
+*   __myfs_mount_implem and handed to every call by the frontend. Nothing of
+*   it is in the image, so locking never writes the image and no pointer or
+*   per-process state ends up in the backup file.
+*       - alloc_lock: guards the bitmaps, their summaries and the free counters
+*       - inode_locks: reader-writer locks striped over the inodes by offset
+*       - dcache: entries of the dentry cache, dcache_sets sets of DCACHE_WAYS
+*       - dcache_sets: number of sets in the dentry cache, a power of two
+*       - dcache_stripes: locks and counters of the dentry cache, striped over its sets
+*       - was_clean: the image was clean when mounted, so nothing but what
+*         the mount wrote can be dirty in the page cache
+*       - atime_mode: when reads update the access time, one of ATIME_*
+*       - lazy_atimes: with lazytime, access times held back from the inodes
+*         by inode slot (the root's last), 0 where none is
+*       - open_counts: by inode slot, descriptors open on the node through
+*         __myfs_open_keep_ino_implem and not released yet
+*       - dirty_blocks: with dirty tracking, a bit per BLOCK_SIZE of the
+*         image set once the block is written and cleared once it is synced
+*       - writeback_blocks: with dirty tracking, a bit per BLOCK_SIZE set
+*         along with dirty_blocks and cleared once the block is synced or
+*         its background writeback is started
+*       - writeback_cursor: block the next background writeback starts at
+*       - alloc_seq: count of bitmap changes, under alloc_lock, ordering the
+*         journal's bitmap records
+*       - journal_on: metadata changes are logged to the journal
+*       - journal_key: each thread's running transaction (see journal_txn)
+*       - journal_lock: guards the fields below and appends to the journal
+*       - journal_cond: signalled when a flush of the journal ends
+*       - journal_flushing: a thread is flushing the journal
+*       - journal_error: a transaction could not be logged, fsync fails until
+*         a full sync writes everything in place
+*       - journal_full: a transaction found no room in the log. Those after it
+*         are not logged either and commits wait, until a checkpoint taken
+*         with every stripe held writes them in place.
+*       - journal_seq: sequence number of the next transaction
+*       - journal_synced: transactions before this one are on stable storage
+*       - journal_head: where in the log the next transaction goes
+*       - journal_used: bytes of the log taken since the last checkpoint
+*       - journal_sync, journal_arg: how the journal and checkpoints are synced
+*/
+typedef struct __myfs_context_struct_t{
+    pthread_mutex_t alloc_lock;
+    pthread_rwlock_t inode_locks[LOCK_STRIPES];
+    dcache_entry *dcache;
+    size_t dcache_sets;
+    dcache_stripe dcache_stripes[DCACHE_STRIPES];
+    int was_clean;
+    int atime_mode;
+    time_t *lazy_atimes;
+    uint32_t *open_counts;
+    uint64_t *dirty_blocks;
+    uint64_t *writeback_blocks;
+    size_t writeback_cursor;
+    uint64_t alloc_seq;
+    int journal_on;
+    pthread_key_t journal_key;
+    pthread_mutex_t journal_lock;
+    pthread_cond_t journal_cond;
+    int journal_flushing;
+    int journal_error;
+    int journal_full;
+    uint64_t journal_seq;
+    uint64_t journal_synced;
+    size_t journal_head;
+    size_t journal_used;
+    sync_callback journal_sync;
+    void *journal_arg;
+}fs_context;
+
+_Static_assert(LOCK_STRIPES <= 64, "stripe sets are kept in a 64-bit mask");
+
+
+/*
+*   Run of contiguous data blocks
+*       - start: number of first data block in the run
+*       - count: number of blocks in the run
+*/
+typedef struct{
+    uint32_t start;
+    uint32_t count;
+}extent;
+
 /*
 *   Node in filesystem tree (directory or file)
 *       - mode: file type and permissions
@@ -278,7 +459,15 @@ typedef struct{
 *       - access_time: last access time
 *       - modification_time: last modification time
 *       - change_time: last change time
-*       - data_block: offset to data block
+*       - num_extents: number of extents holding the data of the node
+*       - extents: first extents of the node, in order
+*       - num_entries: number of entries in a directory
+*       - nlink: number of links to the node, 1 for a file and 2 plus the
+*         number of subdirectories for a directory
+*       - extent_block: offset to block holding the extents past the inline ones
+*       - dir_index: offset to the hash index inode of a directory (0 if unindexed)
+*       - free_hint: first block of a directory that may have room for an entry
+*       - generation: bumped every time the inode is freed, tells a reused inode apart
 */
 typedef struct{
     mode_t mode;
@@ -288,19 +477,155 @@ typedef struct{
     time_t access_time;
     time_t modification_time;
     time_t change_time;
-    size_t data_block;
+    uint32_t num_extents;
+    extent extents[INLINE_EXTENTS];
+    uint32_t num_entries;
+    uint32_t nlink;
+    size_t extent_block;
+    size_t dir_index;
+    uint32_t free_hint;
+    uint32_t generation;
 }inode;
 
+_Static_assert(sizeof(inode) <= INODE_SIZE, "inode must fit in its slot");
+
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(extent))
+#define MAX_EXTENTS (INLINE_EXTENTS + EXTENTS_PER_BLOCK)
+
+/*
+*   Slot of a directory hash index (open addressing, linear probing)
+*       - hash: hash of the entry's name
+*       - entry: byte position of the entry in the directory + 1 (0 for an empty slot)
+*/
+typedef struct{
+    uint32_t hash;
+    uint32_t entry;
+}dir_index_slot;
+
+#define DIR_INDEX_MIN_SLOTS (BLOCK_SIZE / sizeof(dir_index_slot))
+
 /*
-*   Entry inside a directory
-*       - name: name of file
-*       - inode_offset: offset to inode of file
+*   Entry inside a directory, packed back to back in the directory's blocks
+*       - inode_offset: offset to inode of file (0 for free space)
+*       - hash: hash of the name
+*       - rec_len: bytes from this entry to the next one, free space behind it included
+*       - name_len: length of the name
+*       - name: name of file, '\0' terminated
 */
 typedef struct{
-    char name[MAX_FILENAME + 1];
     size_t inode_offset;
+    uint32_t hash;
+    uint16_t rec_len;
+    uint8_t name_len;
+    char name[];
 }directory_entry;
 
+#define DIR_INDEX_MIN_ENTRIES 64
+
+/*
+*   First block of the journal. The rest of it is the log, a ring of
+*   transactions starting at tail. Only a checkpoint, which writes every
+*   change in place first, moves the tail.
+*       - magic: JOURNAL_MAGIC
+*       - tail: offset in the log of the oldest transaction to redo
+*       - tail_seq: its sequence number, the ones after it count up by one
+*/
+typedef struct{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t tail_seq;
+    uint64_t tail;
+}journal_header;
+
+/*
+*   Transaction in the log, followed by its records. A transaction is redone
+*   after a crash only if it is whole, which the checksum tells.
+*       - magic: JOURNAL_TX_MAGIC
+*       - checksum: FNV-1a of the transaction, taken with this field 0
+*       - seq: sequence number
+*       - len: bytes of the transaction with its records, a multiple of 8
+*       - count: number of records
+*/
+typedef struct{
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t seq;
+    uint32_t len;
+    uint32_t count;
+}journal_tx;
+
+/*
+*   Redo record of a transaction
+*       - type: JOURNAL_RANGE: len bytes following the record go to offset
+*               JOURNAL_BLOCK_BITS, JOURNAL_INODE_BITS: bits offset to
+*               offset + len - 1 of the data block or inode bitmap are set
+*               to value
+*               JOURNAL_REINDEX: the hash index of the directory at offset
+*               is built again, instead of logging its slots
+*       - alloc_seq: for bitmap records, alloc_seq of the first bit
+*/
+typedef struct{
+    uint16_t type;
+    uint16_t value;
+    uint32_t len;
+    uint64_t offset;
+    uint64_t alloc_seq;
+}journal_rec;
+
+/*
+*   Inode locked exclusive by a transaction, as it was when locked
+*       - inode_offset: offset to the inode
+*       - bytes: its slot
+*/
+typedef struct{
+    size_t inode_offset;
+    char bytes[INODE_SIZE];
+}journal_held;
+
+/*
+*   Transaction a thread is building. It starts when the thread takes an
+*   exclusive inode lock and is logged when it drops the last one, so the
+*   logged bytes are those its changes left.
+*       - stripes: inode lock stripes the thread holds exclusive
+*       - overflow: records were lost to a failed allocation
+*       - count, cap, recs: the records, the ranges' bytes are copied on logging
+*       - held_count, held_cap, held: the inodes locked exclusive, only
+*         those that changed are logged
+*/
+typedef struct{
+    uint64_t stripes;
+    int overflow;
+    size_t count;
+    size_t cap;
+    journal_rec *recs;
+    size_t held_count;
+    size_t held_cap;
+    journal_held *held;
+}journal_txn;
+
+/*
+*   Callback moving file data between the image and a caller's buffer
+*       - arg: the caller's state
+*       - iov: runs of the image holding the data, in file order
+*       - count: number of runs
+*   Returns the number of bytes moved, or a negative errno value
+*/
+typedef ssize_t (*run_callback)(void *arg, const struct iovec *iov, int count);
+
+/*
+*   Callback taking one entry of a streamed directory listing, shaped like
+*   FUSE's fill_dir_t so the high-level filler can be passed as is
+*       - arg: the caller's state
+*       - name: name of the entry, '\0' terminated
+*       - st: inode number and file type of the node the entry points to
+*       - next: offset to resume the listing behind this entry
+*   Returns non-zero to stop the listing, e.g. once the caller's buffer is full
+*/
+typedef int (*dir_callback)(void *arg, const char *name, const struct stat *st, off_t next);
+
+/*Runs mapped on the stack, files with more extents use the heap*/
+#define STACK_RUNS 16
+
 
 /**************Functions**************/
 
@@ -312,331 +637,2054 @@ static void* offset_to_ptr(void *fsptr, size_t fssize, size_t offset){
 }
 
 /**
- * Init the fs
+ * Set up the locks and settings of a new mount
  */
-static int init_fs(void *fsptr, size_t fssize){
-    /*Info block at beggining of file system*/
-    fs_info_block *info_block = (fs_info_block*)fsptr;
-    
-    /*FS already init*/
-    if(info_block->fs_id == FS_ID) return 1;
+static int init_context(fs_context *ctx){
+    if (pthread_mutex_init(&ctx->alloc_lock, NULL)) return -1;
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        if (pthread_rwlock_init(&ctx->inode_locks[i], NULL)) return -1;
+    }
+    for (int i = 0; i < DCACHE_STRIPES; i++) {
+        if (pthread_mutex_init(&ctx->dcache_stripes[i].lock, NULL)) return -1;
+    }
+    ctx->atime_mode = ATIME_ALWAYS;
+    ctx->lazy_atimes = NULL;
+    ctx->open_counts = NULL;
+    ctx->dirty_blocks = NULL;
+    ctx->writeback_blocks = NULL;
+    ctx->writeback_cursor = 0;
+    ctx->alloc_seq = 0;
+    ctx->journal_on = 0;
+    if (pthread_mutex_init(&ctx->journal_lock, NULL) || pthread_cond_init(&ctx->journal_cond, NULL)) return -1;
+    ctx->journal_flushing = ctx->journal_error = ctx->journal_full = 0;
+    ctx->journal_seq = ctx->journal_synced = 0;
+    ctx->journal_head = ctx->journal_used = 0;
+    ctx->journal_sync = NULL;
+    ctx->journal_arg = NULL;
+    return 0;
+}
 
-    /*Init info block of fs*/
-    info_block->fs_id = FS_ID;
-    info_block->size = fssize;
-    info_block->root_inode = sizeof(fs_info_block);
-    info_block->free_inode_bitmap = info_block->root_inode + INODE_SIZE;
-    info_block->free_block_bitmap = info_block->free_inode_bitmap + (MAX_INODES / 8);
-    info_block->inode_table = info_block->free_block_bitmap + (MAX_DATA_BLOCKS / 8);
-    info_block->data_blocks = info_block->inode_table + (MAX_INODES * INODE_SIZE);
-    info_block->max_data_blocks = MAX_DATA_BLOCKS; 
+/**
+ * Tear down and free the context of a mount, what it allocated included
+ */
+static void free_context(fs_context *ctx){
+    pthread_mutex_destroy(&ctx->alloc_lock);
+    for (int i = 0; i < LOCK_STRIPES; i++) pthread_rwlock_destroy(&ctx->inode_locks[i]);
+    for (int i = 0; i < DCACHE_STRIPES; i++) pthread_mutex_destroy(&ctx->dcache_stripes[i].lock);
+    pthread_mutex_destroy(&ctx->journal_lock);
+    pthread_cond_destroy(&ctx->journal_cond);
+    free(ctx->dcache);
+    free(ctx->lazy_atimes);
+    free(ctx->open_counts);
+    free(ctx->dirty_blocks);
+    free(ctx->writeback_blocks);
+    free(ctx);
+}
 
-    /*Init root*/
-    inode *root = (inode*)offset_to_ptr(fsptr, fssize, info_block->root_inode);
-    root->mode = S_IFDIR | 0755;
-    root->uid = getuid();
-    root->gid = getgid();
-    root->size = 0;
-    root->access_time = root->modification_time = root->change_time = time(NULL);
-    root->data_block = info_block->data_blocks;
+/**
+ * Take or drop the allocation lock, a leaf lock only held around bitmap updates
+ */
+static void lock_alloc(void *fsptr, size_t fssize, fs_context *ctx){
+    pthread_mutex_lock(&ctx->alloc_lock);
+}
 
-    /*Init root dir*/
-    directory_entry *root_dir = (directory_entry*)offset_to_ptr(fsptr, fssize, root->data_block);
-    /*Add .*/
-    strcpy(root_dir[0].name, ".");
-    root_dir[0].inode_offset = info_block->root_inode;
-    /*Add ..*/
-    strcpy(root_dir[1].name, "..");
-    root_dir[1].inode_offset = info_block->root_inode;
-    root->size += 2 * sizeof(directory_entry);
+static void unlock_alloc(void *fsptr, size_t fssize, fs_context *ctx){
+    pthread_mutex_unlock(&ctx->alloc_lock);
+}
 
-    /*Init inode bitmap*/
-    memset(offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap), 0, MAX_INODES / 8);
+/**
+ * Note that len bytes at offset of the image were written. A no-op
+ * unless dirty tracking is on. Writers mark after storing, so a sync
+ * clearing the bit in between still sees the new bytes.
+ */
+static void mark_dirty(void *fsptr, size_t fssize, fs_context *ctx, size_t offset, size_t len){
+    if (!ctx->dirty_blocks || !len || offset >= fssize) return;
+    if (len > fssize - offset) len = fssize - offset;
+    for (size_t b = offset / BLOCK_SIZE; b <= (offset + len - 1) / BLOCK_SIZE; b++) {
+        __atomic_fetch_or(&ctx->dirty_blocks[b / 64], 1ULL << (b % 64), __ATOMIC_RELAXED);
+        __atomic_fetch_or(&ctx->writeback_blocks[b / 64], 1ULL << (b % 64), __ATOMIC_RELAXED);
+    }
+}
 
-    /*Mark root as used*/
-    uint8_t *inode_bitmap = (uint8_t *)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-    inode_bitmap[0] |= (uint8_t)1;
+static void mark_dirty_ptr(void *fsptr, size_t fssize, fs_context *ctx, const void *ptr, size_t len){
+    mark_dirty(fsptr, fssize, ctx, (const char*)ptr - (const char*)fsptr, len);
+}
 
-    /*Init data block bitmap*/
-    memset(offset_to_ptr(fsptr, fssize, info_block->free_block_bitmap), 0, MAX_DATA_BLOCKS / 8);
-    
-    /*Mark root's data block as used*/
-    uint8_t *data_bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_block_bitmap);
-    if (data_bitmap) data_bitmap[0] |= 1;
+/**
+ * Hand the dirty blocks first to last of the image to fn, one call per
+ * contiguous run. With clear their bits are dropped before fn is called,
+ * and set again if it fails. A synced block needs no background writeback
+ * either. Returns -1 if fn failed.
+*/
+static int sync_blocks(void *fsptr, size_t fssize, fs_context *ctx, size_t first, size_t last, int clear, sync_callback fn, void *arg) {
+    uint64_t *bits = ctx->dirty_blocks;
+    uint64_t *writeback = ctx->writeback_blocks;
+    size_t num_blocks = (fssize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (last >= num_blocks) last = num_blocks - 1;
+
+    for (size_t b = first; b <= last; ) {
+        /*Skip clean words whole*/
+        uint64_t word = __atomic_load_n(&bits[b / 64], __ATOMIC_RELAXED) >> (b % 64);
+        if (!word) {
+            b = (b / 64 + 1) * 64;
+            continue;
+        }
+        b += __builtin_ctzll(word);
+        if (b > last) break;
+
+        /*Run on while the blocks stay dirty*/
+        size_t end = b + 1;
+        while (end <= last && (__atomic_load_n(&bits[end / 64], __ATOMIC_RELAXED) >> (end % 64) & 1)) end++;
+        for (size_t n = b; clear && n < end; n++) {
+            __atomic_fetch_and(&bits[n / 64], ~(1ULL << (n % 64)), __ATOMIC_RELAXED);
+            __atomic_fetch_and(&writeback[n / 64], ~(1ULL << (n % 64)), __ATOMIC_RELAXED);
+        }
 
-    /*FS is init. Yay*/
-    return 1;
+        size_t offset = b * BLOCK_SIZE, len = (end - b) * BLOCK_SIZE;
+        if (len > fssize - offset) len = fssize - offset;
+        if (fn(arg, offset, len)) {
+            if (clear) mark_dirty(fsptr, fssize, ctx, offset, len);
+            return -1;
+        }
+        b = end;
+    }
+    return 0;
 }
 
 /**
- * Find a node in the filesystem
+ * Transaction the calling thread is building, NULL unless journaling is on
+ * and the thread holds an exclusive inode lock
  */
-static inode* find_inode(void *fsptr, size_t fssize, const char * path, size_t *inode_offset_ptr){
-    /*Get initial filesystem info*/
-    fs_info_block *info_block = (fs_info_block*)fsptr;
-    inode *curr_inode = (inode *)offset_to_ptr(fsptr, fssize, info_block->root_inode);
-    size_t curr_offset = info_block->root_inode;
+static journal_txn* journal_txn_get(void *fsptr, size_t fssize, fs_context *ctx){
+    if (!ctx->journal_on) return NULL;
+    journal_txn *txn = (journal_txn*)pthread_getspecific(ctx->journal_key);
+    return (txn && txn->stripes) ? txn : NULL;
+}
 
-    /*Path is root*/
-    if(!strcmp(path, "/")){
-        *inode_offset_ptr = curr_offset;
-        return curr_inode;
+/**
+ * Add a record to a transaction. Operations log the same inode over and
+ * over, so a repeat of one of the last few records is dropped.
+ */
+static void journal_add(journal_txn *txn, uint16_t type, uint16_t value, uint64_t offset, uint32_t len, uint64_t alloc_seq){
+    for (size_t i = txn->count; i > 0 && i + 8 > txn->count; i--) {
+        journal_rec *rec = &txn->recs[i - 1];
+        if (rec->type == type && rec->offset == offset && rec->len == len && type != JOURNAL_BLOCK_BITS && type != JOURNAL_INODE_BITS) return;
     }
 
-    /*Tokenize path*/
-    char *path_cpy = strdup(path);
-
-    /*No path provided*/
-    if (!path_cpy) return NULL;
-
-    /*Tokenize path*/
-    char *token = strtok(path_cpy, "/");
-    while(token){
-        if(!(curr_inode->mode & S_IFDIR)){
-                free(path_cpy);
-                return NULL;
+    if (txn->count == txn->cap) {
+        size_t cap = txn->cap ? txn->cap * 2 : 16;
+        journal_rec *recs = (journal_rec*)realloc(txn->recs, cap * sizeof(journal_rec));
+        if (!recs) {
+            txn->overflow = 1;
+            return;
         }
+        txn->recs = recs;
+        txn->cap = cap;
+    }
+    txn->recs[txn->count++] = (journal_rec){type, value, len, offset, alloc_seq};
+}
 
-        /*Iterate through directory*/
-        directory_entry *entries = (directory_entry *)offset_to_ptr(fsptr, fssize, curr_inode->data_block);
-        size_t num_entries = curr_inode->size / sizeof(directory_entry), next_offset = 0;
-        inode *next_inode = NULL;
-        int found = 0;
-
-        for(size_t i = 0; i < num_entries; i++){
-                if(!strcmp(entries[i].name, token)){
-                    next_offset = entries[i].inode_offset;
-                    next_inode = (inode *)offset_to_ptr(fsptr, fssize, next_offset);
-                    found = 1;
-                    break;
-                }
-        }
+/**
+ * Note that len bytes of metadata at ptr were written. They are marked
+ * dirty, and the running transaction logs them as they are when it ends.
+ */
+static void log_meta(void *fsptr, size_t fssize, fs_context *ctx, const void *ptr, size_t len){
+    mark_dirty_ptr(fsptr, fssize, ctx, ptr, len);
+    journal_txn *txn = journal_txn_get(fsptr, fssize, ctx);
+    if (txn) journal_add(txn, JOURNAL_RANGE, 0, (const char*)ptr - (const char*)fsptr, len, 0);
+}
 
-        /*Inode not found, you must DIE*/
-        if(!found){
-                free(path_cpy);
-                return NULL;
+/**
+ * Note an inode locked exclusive by a transaction, as it is now. It is
+ * marked dirty and logged when the transaction ends, if it changed by then.
+ */
+static void journal_hold(void *fsptr, size_t fssize, fs_context *ctx, journal_txn *txn, size_t inode_offset){
+    if (txn->held_count == txn->held_cap) {
+        size_t cap = txn->held_cap ? txn->held_cap * 2 : 4;
+        journal_held *held = (journal_held*)realloc(txn->held, cap * sizeof(journal_held));
+        if (!held) {
+            /*Logged whether it changes or not*/
+            log_meta(fsptr, fssize, ctx, (char*)fsptr + inode_offset, INODE_SIZE);
+            return;
         }
-
-        /*Move to next inode...*/
-        curr_inode = next_inode;
-        curr_offset = next_offset;
-        token = strtok(NULL, "/");
+        txn->held = held;
+        txn->held_cap = cap;
     }
+    journal_held *h = &txn->held[txn->held_count++];
+    h->inode_offset = inode_offset;
+    memcpy(h->bytes, (char*)fsptr + inode_offset, INODE_SIZE);
+}
 
-    /*Cleanup and return*/
-    free(path_cpy);
-    if(inode_offset_ptr) *inode_offset_ptr = curr_offset;
-    return curr_inode;
+/**
+ * Free a thread's transaction when it exits
+ */
+static void journal_txn_free(void *arg){
+    journal_txn *txn = (journal_txn*)arg;
+    free(txn->recs);
+    free(txn->held);
+    free(txn);
 }
 
 /**
- * Split path into parent dir and base name
+ * Log that bit n of a bitmap was set to value. The caller holds the
+ * allocation lock, which orders the changes. Runs of bits changed one
+ * after the other share a record.
  */
-static int split_path(const char *path, char **parent_path, char **base_name) {
-    /*Empty directory*/
-    if (!path || !parent_path || !base_name) return -1;
-    
-    /*Create path copy*/
-    char *path_cpy = strdup(path);
-    if (!path_cpy) return -1;
-    
-    /*Find last slash*/
-    char *last_slash = strrchr(path_cpy, '/');
-    /* Invalid path */
-    if (last_slash == NULL) {
-        free(path_cpy);
-        return -1;
+static void log_bit(void *fsptr, size_t fssize, fs_context *ctx, uint16_t type, size_t n, int value){
+    journal_txn *txn = journal_txn_get(fsptr, fssize, ctx);
+    if (!txn) return;
+    uint64_t alloc_seq = ctx->alloc_seq++;
+
+    journal_rec *last = txn->count ? &txn->recs[txn->count - 1] : NULL;
+    if (last && last->type == type && last->value == value && last->len < UINT32_MAX && last->alloc_seq + last->len == alloc_seq) {
+        if (n == last->offset + last->len) {
+            last->len++;
+            return;
+        }
+        if (n + 1 == last->offset) {
+            last->offset--;
+            last->len++;
+            return;
+        }
     }
+    journal_add(txn, type, (uint16_t)value, n, 1, alloc_seq);
+}
 
-    /*Parent directory is root*/
-    if (last_slash == path_cpy) *parent_path = strdup("/");
-    else {
-        *last_slash = '\0';
-        *parent_path = strdup(path_cpy);
+/**
+ * FNV-1a of len bytes, continuing from hash
+ */
+static uint32_t journal_checksum(uint32_t hash, const void *data, size_t len){
+    const uint8_t *bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
     }
-    if(!(*parent_path)) {
-        free(path_cpy);
-        return -1;
+    return hash;
+}
+
+/**
+ * Get the journal header, the log follows in the next block
+ */
+static journal_header* get_journal(void *fsptr, size_t fssize){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    return (journal_header*)offset_to_ptr(fsptr, fssize, info_block->journal);
+}
+
+/**
+ * Write every dirty block in place, then empty the journal, none of its
+ * transactions need redoing anymore. The caller holds journal_lock and
+ * every stripe, so no call is halfway through its changes and no dirty
+ * bit a call has yet to set is cleared. Returns -1 if fn failed, the
+ * journal is kept then.
+ */
+static int journal_checkpoint(void *fsptr, size_t fssize, fs_context *ctx, sync_callback fn, void *arg){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    journal_header *header = get_journal(fsptr, fssize);
+    if (sync_blocks(fsptr, fssize, ctx, 0, (size_t)-1, 1, fn, arg)) return -1;
+
+    /*Only then drop the transactions*/
+    header->tail = 0;
+    header->tail_seq = ctx->journal_seq;
+    if (fn(arg, info_block->journal, BLOCK_SIZE)) return -1;
+    ctx->journal_head = ctx->journal_used = 0;
+    ctx->journal_synced = ctx->journal_seq;
+    ctx->journal_error = ctx->journal_full = 0;
+    pthread_cond_broadcast(&ctx->journal_cond);
+    return 0;
+}
+
+/**
+ * Whether a transaction's records leave the inode or data block holding
+ * offset free. Other threads may have taken it since, so its bytes are
+ * neither the transaction's to log nor safe to read.
+ */
+static int journal_freed(void *fsptr, journal_txn *txn, size_t offset){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    uint16_t type;
+    size_t n;
+    if (offset >= info_block->data_blocks) {
+        type = JOURNAL_BLOCK_BITS;
+        n = (offset - info_block->data_blocks) / BLOCK_SIZE;
+    } else if (offset >= info_block->inode_table) {
+        type = JOURNAL_INODE_BITS;
+        n = (offset - info_block->inode_table) / INODE_SIZE;
+    } else {
+        return 0;
     }
-    
-    /*Git base name*/
-    *base_name = strdup(last_slash + 1);
-    if (!(*base_name)) {
-        free(path_cpy);
-        free(*parent_path);
-        return -1;
+
+    /*The last change to the bit counts*/
+    for (size_t i = txn->count; i > 0; i--) {
+        journal_rec *rec = &txn->recs[i - 1];
+        if (rec->type == type && n >= rec->offset && n - rec->offset < rec->len) return !rec->value;
     }
-    
-    /*Cleanup and return*/
-    free(path_cpy);
     return 0;
 }
 
-/*Find a free inode*/
-static size_t find_free_inode(void *fsptr, size_t fssize) {
-    size_t inode_num, inode_offset;
-    /*Make info block*/
-    fs_info_block *info_block = (fs_info_block*)fsptr;\
-    /*Get offset to ptr for start of bitmap*/
-    uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-    if (!bitmap) return (size_t)-1;
-    
-    /*Iterate through iNodes, by Apple™*/
-    for (size_t byte = 0; byte < MAX_INODES / 8; byte++) {
-        /*Byte not equal to -1 char*/
-        if (bitmap[byte] != 0xFF) {
-            /*Iterate through bits*/
-            for (int bit = 0; bit < 8; bit++) {
-                inode_num = byte * 8 + bit;
-                /*Reached last iNode, by Apple™*/
-                if (inode_num >= MAX_INODES) break;
-                /*Check if current iNode, by Apple™, is free*/
-                if (!(bitmap[byte] & (1 << bit))) {
-                    /*Mark iNode, by Apple™, as used*/
-                    bitmap[byte] |= (1 << bit);
-                    /*Calculate offset to iNode, by Apple™*/
-                    inode_offset = info_block->inode_table + inode_num * INODE_SIZE;
-                    /*Return offse*/
-                    return inode_offset;
-                }
-            }
-        }
+/**
+ * Log a thread's transaction, copying the bytes of its ranges as they are
+ * now. The caller still holds its inode locks. A transaction that changed
+ * nothing is not logged. One that finds no room in the log, or comes after
+ * one that didn't, is left to a checkpoint instead. Returns 1 if the caller
+ * is to make room with journal_make_room once it dropped its locks.
+ */
+static int journal_append(void *fsptr, size_t fssize, fs_context *ctx, journal_txn *txn){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    size_t log_bytes = (info_block->journal_blocks - 1) * BLOCK_SIZE;
+    char *log = (char*)fsptr + info_block->journal + BLOCK_SIZE;
+
+    /*The inodes it locked, those it changed and didn't free. They are
+      stored by now, so they can be marked.*/
+    for (size_t i = 0; i < txn->held_count; i++) {
+        journal_held *h = &txn->held[i];
+        char *slot = (char*)fsptr + h->inode_offset;
+        if (journal_freed(fsptr, txn, h->inode_offset) || !memcmp(slot, h->bytes, INODE_SIZE)) continue;
+        mark_dirty_ptr(fsptr, fssize, ctx, slot, INODE_SIZE);
+        journal_add(txn, JOURNAL_RANGE, 0, h->inode_offset, INODE_SIZE, 0);
     }
-    
-    /*You have failed me Anakin*/
-    return (size_t)-1;
-}
+    txn->held_count = 0;
+
+    /*Drop ranges in what the transaction freed*/
+    size_t kept = 0;
+    for (size_t i = 0; i < txn->count; i++) {
+        if (txn->recs[i].type == JOURNAL_RANGE && journal_freed(fsptr, txn, txn->recs[i].offset)) continue;
+        txn->recs[kept++] = txn->recs[i];
+    }
+    txn->count = kept;
+    if (!txn->count && !txn->overflow) return 0;
 
-int add_dir_entry(void *fsptr, size_t fssize, inode *dir_inode, size_t dir_inode_offset, const char *name, size_t new_inode_offset) {
-    /*Get current number of entries from dir*/
-    size_t num_entries = dir_inode->size / sizeof(directory_entry), max_entries = BLOCK_SIZE / sizeof(directory_entry);
+    size_t need = sizeof(journal_tx);
+    for (size_t i = 0; i < txn->count; i++) {
+        if (txn->recs[i].type == JOURNAL_RANGE) need += (txn->recs[i].len + 7) & ~(size_t)7;
+        need += sizeof(journal_rec);
+    }
+
+    /*Wrap around if it doesn't fit before the end of the log*/
+    int full = 0;
+    pthread_mutex_lock(&ctx->journal_lock);
+    size_t skip = (ctx->journal_head + need > log_bytes) ? log_bytes - ctx->journal_head : 0;
+    if (ctx->journal_full || txn->overflow || ctx->journal_used + skip + need > log_bytes) {
+        ctx->journal_full = full = 1;
+        goto done;
+    }
+    if (skip) {
+        ctx->journal_used += skip;
+        ctx->journal_head = 0;
+    }
 
-    /*We can't add more dir entries!! too many*/
-    if (num_entries >= max_entries) return -1; 
+    /*Header, then each record and its bytes*/
+    journal_tx *tx = (journal_tx*)(log + ctx->journal_head);
+    *tx = (journal_tx){JOURNAL_TX_MAGIC, 0, ctx->journal_seq, (uint32_t)need, (uint32_t)txn->count};
+    char *pos = (char*)(tx + 1);
+    for (size_t i = 0; i < txn->count; i++) {
+        journal_rec *rec = &txn->recs[i];
+        memcpy(pos, rec, sizeof(journal_rec));
+        pos += sizeof(journal_rec);
+        if (rec->type == JOURNAL_RANGE) {
+            memcpy(pos, (char*)fsptr + rec->offset, rec->len);
+            memset(pos + rec->len, 0, ((rec->len + 7) & ~(size_t)7) - rec->len);
+            pos += (rec->len + 7) & ~(size_t)7;
+        }
+    }
+    tx->checksum = journal_checksum(2166136261u, tx, need);
 
-    /*Make new entry*/
-    directory_entry *new_entry = (directory_entry*)offset_to_ptr(fsptr, fssize, dir_inode->data_block + num_entries * sizeof(directory_entry));
+    ctx->journal_seq++;
+    ctx->journal_head += need;
+    ctx->journal_used += need;
 
-    /*Bad offset*/
-    if (!new_entry) return -1;
+done:
+    pthread_mutex_unlock(&ctx->journal_lock);
+    txn->count = 0;
+    txn->overflow = 0;
+    return full;
+}
 
-    /*Copy name into new dir entry*/
-    strncpy(new_entry->name, name, MAX_FILENAME - 1);
-    new_entry->name[MAX_FILENAME - 1] = '\0'; 
+/**
+ * Checkpoint a log some transaction found no room in, unless another
+ * thread did already. The caller holds every stripe shared, as for a full
+ * sync, so no transaction is open and none can fill the log meanwhile.
+ */
+static void journal_make_room(void *fsptr, size_t fssize, fs_context *ctx){
+    pthread_mutex_lock(&ctx->journal_lock);
+    if (ctx->journal_full && journal_checkpoint(fsptr, fssize, ctx, ctx->journal_sync, ctx->journal_arg)) {
+        ctx->journal_error = 1;
+        pthread_cond_broadcast(&ctx->journal_cond);
+    }
+    pthread_mutex_unlock(&ctx->journal_lock);
+}
 
-    /*Set offset (huh, kinda rhymed)*/
-    new_entry->inode_offset = new_inode_offset;
+/**
+ * Make every transaction logged so far durable. One thread flushes the
+ * journal for all that wait meanwhile, so concurrent fsyncs share a flush.
+ */
+static int journal_commit(void *fsptr, size_t fssize, fs_context *ctx){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    int res = 0;
 
-    /*Update size of dir*/
-    dir_inode->size += sizeof(directory_entry);
+    pthread_mutex_lock(&ctx->journal_lock);
 
-    /*Update times*/
-    dir_inode->modification_time = dir_inode->change_time = time(NULL);
+    /*Transactions left to a checkpoint are only durable once it's done*/
+    while (ctx->journal_full && !ctx->journal_error) pthread_cond_wait(&ctx->journal_cond, &ctx->journal_lock);
 
-    /*All good in the hood*/
-    return 0; 
-}
+    uint64_t target = ctx->journal_seq;
+    while (!ctx->journal_error && ctx->journal_synced < target) {
+        /*Someone is at it, our transactions may be in their flush*/
+        if (ctx->journal_flushing) {
+            pthread_cond_wait(&ctx->journal_cond, &ctx->journal_lock);
+            continue;
+        }
 
+        /*Flush for everyone logged so far*/
+        uint64_t upto = ctx->journal_seq;
+        ctx->journal_flushing = 1;
+        pthread_mutex_unlock(&ctx->journal_lock);
+        res = ctx->journal_sync(ctx->journal_arg, info_block->journal, info_block->journal_blocks * BLOCK_SIZE);
+        pthread_mutex_lock(&ctx->journal_lock);
+        ctx->journal_flushing = 0;
+        if (!res && upto > ctx->journal_synced) ctx->journal_synced = upto;
+        pthread_cond_broadcast(&ctx->journal_cond);
+        if (res) break;
+    }
+    if (ctx->journal_error) res = -1;
+    pthread_mutex_unlock(&ctx->journal_lock);
+    return res ? -1 : 0;
+}
 
 /**
- * Remove entry from dir inode
-*/
-static int remove_dir_entry(void *fsptr, size_t fssize, inode *dir_inode, size_t dir_inode_offset, const char *name) {
-    /*Get entries from dir*/
-    directory_entry *entries = (directory_entry *)offset_to_ptr(fsptr, fssize, dir_inode->data_block);
-    if (!entries) return -1;
-    
-    /*Gets num entries used for dir*/
-    size_t num_entries = dir_inode->size / sizeof(directory_entry);
-    size_t target_index = num_entries;
-    
-    /*Seek*/
-    for (size_t i = 0; i < num_entries; i++) {
-        if (strcmp(entries[i].name, name) == 0) {
-                target_index = i;
-                break;
-        }
+ * Set of stripes covering count inodes, offsets of 0 stand for no inode
+ */
+static uint64_t stripe_mask(const size_t *inode_offsets, int count){
+    uint64_t mask = 0;
+    for (int i = 0; i < count; i++) {
+        if (inode_offsets[i]) mask |= 1ULL << (inode_offsets[i] / INODE_SIZE % LOCK_STRIPES);
     }
-    
-    /*Entry not found, we'll get it next time*/
-    if (target_index == num_entries) return -1;
-    
-    /*sll entries*/
-    for (size_t i = target_index; i < num_entries - 1; i++) entries[i] = entries[i + 1];
-    
-    /*Zero out the last entry (DEstroy)*/
-    memset(&entries[num_entries - 1], 0, sizeof(directory_entry));
-    
-    /*Update size*/
-    dir_inode->size -= sizeof(directory_entry);
-    
-    /*Update times*/
-    dir_inode->modification_time = dir_inode->change_time = time(NULL);
-    
-    /*Target obliterated*/
-    return 0; 
+    return mask;
 }
 
 /**
- * Find free data block
-*/
-static size_t find_free_data_block(void *fsptr, size_t fssize) {
-    /*Get the info block*/
-    fs_info_block *info_block = (fs_info_block*)fsptr;
-    /*Get the max number of data blocks*/
-    size_t max_data_blocks = info_block->max_data_blocks; 
-    /*Get the bitmap offset*/
-    unsigned char *bitmap = (unsigned char*)offset_to_ptr(fsptr, fssize, info_block->free_block_bitmap);
-    if (!bitmap) return (size_t)-1;
+ * Lock count inodes shared or exclusive. Each stripe is taken once and in
+ * ascending order, so callers locking several inodes can't deadlock.
+ */
+static void lock_inodes(void *fsptr, size_t fssize, fs_context *ctx, const size_t *inode_offsets, int count, int exclusive){
+    for (uint64_t mask = stripe_mask(inode_offsets, count); mask; mask &= mask - 1) {
+        pthread_rwlock_t *lock = &ctx->inode_locks[__builtin_ctzll(mask)];
+        if (exclusive) pthread_rwlock_wrlock(lock);
+        else pthread_rwlock_rdlock(lock);
+    }
 
-    /*Block offset, 'init*/
-    size_t block_offset;
-
-    /*Iterate through data blocks*/
-    for (size_t block_num = 0; block_num < max_data_blocks; block_num++) {
-        /*Check if block is free*/
-        if (!(bitmap[block_num / 8] & (1 << (block_num % 8)))) {
-            /*Mark block as used*/
-            bitmap[block_num / 8] |= (1 << (block_num % 8));
-            /*Calculate block offset*/
-            block_offset = info_block->data_blocks + block_num * BLOCK_SIZE;
-            return block_offset;
+    /*An exclusive lock starts or joins the thread's transaction*/
+    if (exclusive && ctx->journal_on) {
+        journal_txn *txn = (journal_txn*)pthread_getspecific(ctx->journal_key);
+        if (!txn && (txn = (journal_txn*)calloc(1, sizeof(journal_txn))) && pthread_setspecific(ctx->journal_key, txn)) {
+            free(txn);
+            txn = NULL;
+        }
+        if (txn) {
+            txn->stripes |= stripe_mask(inode_offsets, count);
+        } else {
+            pthread_mutex_lock(&ctx->journal_lock);
+            ctx->journal_error = 1;
+            pthread_mutex_unlock(&ctx->journal_lock);
         }
     }
 
-    /*No free data blocks, critical failure, oh no!, it's gonna blow up!*/
-    return (size_t)-1;
+    /*Whatever changes under an exclusive lock can't be synced or logged
+      before it is dropped. A transaction keeps the inodes as they are, to
+      log those that changed once it ends. Without one they are marked up
+      front.*/
+    journal_txn *txn = exclusive ? journal_txn_get(fsptr, fssize, ctx) : NULL;
+    for (int i = 0; exclusive && i < count; i++) {
+        if (!inode_offsets[i]) continue;
+        if (txn) journal_hold(fsptr, fssize, ctx, txn, inode_offsets[i]);
+        else mark_dirty(fsptr, fssize, ctx, inode_offsets[i], INODE_SIZE);
+    }
 }
 
+/**
+ * Unlock inodes locked together by lock_inodes
+ */
+static void unlock_inodes(void *fsptr, size_t fssize, fs_context *ctx, const size_t *inode_offsets, int count){
+
+    /*Dropping the last exclusive stripe ends the transaction, it is logged
+      while its changes are still locked*/
+    uint64_t mask = stripe_mask(inode_offsets, count);
+    journal_txn *txn = journal_txn_get(fsptr, fssize, ctx);
+    int full = 0;
+    if (txn && (txn->stripes & mask)) {
+        txn->stripes &= ~mask;
+        if (!txn->stripes) full = journal_append(fsptr, fssize, ctx, txn);
+    }
+
+    for (; mask; mask &= mask - 1) {
+        pthread_rwlock_unlock(&ctx->inode_locks[__builtin_ctzll(mask)]);
+    }
+
+    /*Nothing is locked anymore, so every stripe can be taken, in order*/
+    if (!full) return;
+    for (int i = 0; i < LOCK_STRIPES; i++) pthread_rwlock_rdlock(&ctx->inode_locks[i]);
+    journal_make_room(fsptr, fssize, ctx);
+    for (int i = 0; i < LOCK_STRIPES; i++) pthread_rwlock_unlock(&ctx->inode_locks[i]);
+}
 
 /**
- * Frees data block and updates bitmap 
-*/
-static int free_data_block(void *fsptr, size_t fssize, size_t block_offset) {
-    /*Get the info block*/
+ * Access time of a node held back by lazytime, NULL without lazytime
+ */
+static time_t* lazy_atime(void *fsptr, size_t fssize, fs_context *ctx, size_t inode_offset){
     fs_info_block *info_block = (fs_info_block*)fsptr;
-    /*Check if block offset is valid*/
-    if (block_offset < info_block->data_blocks || block_offset >= fssize) return -1;
-    
-    /*Calculate block number*/
-    size_t block_num = (block_offset - info_block->data_blocks) / BLOCK_SIZE;
-    if (block_num >= info_block->max_data_blocks) return -1;
-    
+    if (!ctx->lazy_atimes) return NULL;
+    if (inode_offset == info_block->root_inode) return &ctx->lazy_atimes[info_block->max_inodes];
+    return &ctx->lazy_atimes[(inode_offset - info_block->inode_table) / INODE_SIZE];
+}
+
+/**
+ * Access time of a node, counting one held back by lazytime
+ */
+static time_t node_atime(void *fsptr, size_t fssize, fs_context *ctx, inode *node, size_t inode_offset){
+    time_t *pending = lazy_atime(fsptr, fssize, ctx, inode_offset);
+    time_t atime = pending ? __atomic_load_n(pending, __ATOMIC_RELAXED) : 0;
+    return atime ? atime : __atomic_load_n(&node->access_time, __ATOMIC_RELAXED);
+}
+
+/**
+ * Update the access time of a node that was read, as the mount's atime
+ * mode says. The caller holds the node locked shared, so the stores are
+ * atomic. With lazytime the time is held back instead of dirtying the
+ * inode table.
+ */
+static void touch_atime(void *fsptr, size_t fssize, fs_context *ctx, inode *node, size_t inode_offset){
+    int mode = ctx->atime_mode;
+    if (mode == ATIME_NEVER) return;
+
+    /*relatime only moves it if it is behind the last change, or a day old*/
+    time_t now = time(NULL);
+    if (mode == ATIME_RELATIME) {
+        time_t atime = node_atime(fsptr, fssize, ctx, node, inode_offset);
+        if (atime > node->modification_time && atime > node->change_time && now - atime < RELATIME_INTERVAL) return;
+    }
+
+    time_t *pending = lazy_atime(fsptr, fssize, ctx, inode_offset);
+    if (pending) {
+        __atomic_store_n(pending, now, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&node->access_time, now, __ATOMIC_RELAXED);
+        mark_dirty_ptr(fsptr, fssize, ctx, node, INODE_SIZE);
+    }
+}
+
+/**
+ * Move a node's held back access time into its inode. The caller holds
+ * the node locked.
+ */
+static void flush_atime(void *fsptr, size_t fssize, fs_context *ctx, inode *node, size_t inode_offset){
+    time_t *pending = lazy_atime(fsptr, fssize, ctx, inode_offset);
+    time_t atime = pending ? __atomic_exchange_n(pending, 0, __ATOMIC_RELAXED) : 0;
+    if (atime) {
+        __atomic_store_n(&node->access_time, atime, __ATOMIC_RELAXED);
+        mark_dirty_ptr(fsptr, fssize, ctx, node, INODE_SIZE);
+    }
+}
+
+/**
+ * Bytes taken by a bitmap of n bits, padded to whole 64-bit words
+ */
+static size_t bitmap_bytes(size_t n){
+    return ((n + 63) / 64) * sizeof(uint64_t);
+}
+
+/**
+ * Word w of a bitmap, arranged so bit n of the map is bit n % 64 of its word
+ */
+static inline uint64_t bitmap_word(const uint64_t *words, size_t w){
+    uint64_t word = words[w];
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+#ifdef HAVE_AVX2_SCAN
+/**
+ * First word at or after w that has a clear bit, checking 256 bits a step
+ */
+__attribute__((target("avx2")))
+static size_t bitmap_skip_full_avx2(const uint64_t *words, size_t w, size_t nwords){
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    for (; w + 4 <= nwords; w += 4) {
+        __m256i span = _mm256_loadu_si256((const __m256i*)(words + w));
+        if (!_mm256_testc_si256(span, ones)) break;
+    }
+    return w;
+}
+#endif
+
+/**
+ * Number of the first clear bit below nbits in a bitmap, (size_t)-1 if all
+ * are set. Full words are skipped whole and ctz picks the bit.
+ */
+static size_t bitmap_find_clear(const uint64_t *words, size_t nbits){
+    size_t nwords = (nbits + 63) / 64, w = 0;
+
+#ifdef HAVE_AVX2_SCAN
+    if (__builtin_cpu_supports("avx2")) w = bitmap_skip_full_avx2(words, w, nwords);
+#endif
+
+    for (; w < nwords; w++) {
+        uint64_t word = bitmap_word(words, w);
+        if (word == UINT64_MAX) continue;
+        /*Padding past nbits may be set or clear, a clear bit there means
+          nothing below nbits is free*/
+        size_t n = w * 64 + __builtin_ctzll(~word);
+        return n < nbits ? n : (size_t)-1;
+    }
+    return (size_t)-1;
+}
+
+/**
+ * Number of clear bits below nbits in a bitmap
+ */
+static size_t bitmap_count_clear(const uint64_t *words, size_t nbits){
+    size_t used = 0;
+    for (size_t w = 0; w < nbits / 64; w++) used += __builtin_popcountll(words[w]);
+    if (nbits % 64) used += __builtin_popcountll(bitmap_word(words, nbits / 64) & ((1ULL << (nbits % 64)) - 1));
+    return nbits - used;
+}
+
+/**
+ * Bits in level level of the data block map. Level 0 is the bitmap itself,
+ * each level above has one bit per word of the level below.
+ */
+static size_t block_map_bits(size_t max_data_blocks, int level){
+    size_t nbits = max_data_blocks;
+    while (level--) nbits = (nbits + 63) / 64;
+    return nbits;
+}
+
+/**
+ * Bytes taken by the summary levels of the data block map
+ */
+static size_t block_summary_bytes(size_t max_data_blocks){
+    size_t bytes = 0;
+    for (int level = 1; level <= SUMMARY_LEVELS; level++) bytes += bitmap_bytes(block_map_bits(max_data_blocks, level));
+    return bytes;
+}
+
+/**
+ * Get level level of the data block map
+ */
+static uint64_t* block_map_level(void *fsptr, size_t fssize, int level){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    return (uint64_t*)offset_to_ptr(fsptr, fssize, level ? info_block->block_summary[level - 1] : info_block->free_block_bitmap);
+}
+
+/**
+ * Mark data block block_num used. A summary bit is set once the word below
+ * it fills up, so the levels above only change every 64 allocations.
+ */
+static void mark_block_used(void *fsptr, size_t fssize, fs_context *ctx, size_t block_num){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    uint8_t *bitmap = (uint8_t*)block_map_level(fsptr, fssize, 0);
+    if (!bitmap || bitmap[block_num / 8] & (1 << (block_num % 8))) return;
+    info_block->free_blocks--;
+    log_bit(fsptr, fssize, ctx, JOURNAL_BLOCK_BITS, block_num, 1);
+
+    for (int level = 0; level <= SUMMARY_LEVELS; level++) {
+        uint64_t *map = block_map_level(fsptr, fssize, level);
+        if (!map) return;
+        ((uint8_t*)map)[block_num / 8] |= 1 << (block_num % 8);
+        mark_dirty_ptr(fsptr, fssize, ctx, (uint8_t*)map + block_num / 8, 1);
+        if (map[block_num / 64] != UINT64_MAX) break;
+        block_num /= 64;
+    }
+    mark_dirty(fsptr, fssize, ctx, 0, sizeof(fs_info_block));
+}
+
+/**
+ * Mark data block block_num free, the words above it can't be full anymore
+ */
+static void mark_block_free(void *fsptr, size_t fssize, fs_context *ctx, size_t block_num){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    uint8_t *bitmap = (uint8_t*)block_map_level(fsptr, fssize, 0);
+    if (!bitmap || !(bitmap[block_num / 8] & (1 << (block_num % 8)))) return;
+    info_block->free_blocks++;
+    log_bit(fsptr, fssize, ctx, JOURNAL_BLOCK_BITS, block_num, 0);
+
+    for (int level = 0; level <= SUMMARY_LEVELS; level++) {
+        uint64_t *map = block_map_level(fsptr, fssize, level);
+        if (!map) return;
+        ((uint8_t*)map)[block_num / 8] &= ~(1 << (block_num % 8));
+        mark_dirty_ptr(fsptr, fssize, ctx, (uint8_t*)map + block_num / 8, 1);
+        block_num /= 64;
+    }
+    mark_dirty(fsptr, fssize, ctx, 0, sizeof(fs_info_block));
+}
+
+/**
+ * Mark inode inode_num used
+ */
+static void mark_inode_used(void *fsptr, size_t fssize, fs_context *ctx, size_t inode_num){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
+    if (!bitmap || inode_num >= info_block->max_inodes || bitmap[inode_num / 8] & (1 << (inode_num % 8))) return;
+    bitmap[inode_num / 8] |= (1 << (inode_num % 8));
+    info_block->free_inodes--;
+    log_bit(fsptr, fssize, ctx, JOURNAL_INODE_BITS, inode_num, 1);
+    mark_dirty_ptr(fsptr, fssize, ctx, &bitmap[inode_num / 8], 1);
+    mark_dirty(fsptr, fssize, ctx, 0, sizeof(fs_info_block));
+}
+
+/**
+ * Mark inode inode_num free
+ */
+static void mark_inode_free(void *fsptr, size_t fssize, fs_context *ctx, size_t inode_num){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
+    if (!bitmap || inode_num >= info_block->max_inodes || !(bitmap[inode_num / 8] & (1 << (inode_num % 8)))) return;
+    bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
+    info_block->free_inodes++;
+    log_bit(fsptr, fssize, ctx, JOURNAL_INODE_BITS, inode_num, 0);
+    mark_dirty_ptr(fsptr, fssize, ctx, &bitmap[inode_num / 8], 1);
+    mark_dirty(fsptr, fssize, ctx, 0, sizeof(fs_info_block));
+}
+
+/*Dentry cache entries are kept cache line aligned*/
+#define DCACHE_ALIGN 64
+
+/**
+ * Sets of the dentry cache for max_inodes inodes, one entry per
+ * INODES_PER_DCACHE_ENTRY inodes rounded down to a power of two sets
+ */
+static size_t dcache_sets(size_t max_inodes){
+    size_t sets = 1;
+    while (sets < DCACHE_MAX_SETS && sets * 2 * DCACHE_WAYS * INODES_PER_DCACHE_ENTRY <= max_inodes) sets *= 2;
+    return sets;
+}
+
+/**
+ * Blocks of the journal for max_inodes inodes, its header's included
+ */
+static size_t journal_blocks(size_t max_inodes){
+    size_t blocks = max_inodes / INODES_PER_JOURNAL_BLOCK;
+    if (blocks < JOURNAL_MIN_BLOCKS) blocks = JOURNAL_MIN_BLOCKS;
+    if (blocks > JOURNAL_MAX_BLOCKS) blocks = JOURNAL_MAX_BLOCKS;
+    return blocks;
+}
+
+/**
+ * Offset of the first data block once the metadata for the given number
+ * of inodes and data blocks is laid out
+ */
+static size_t data_blocks_offset(size_t max_inodes, size_t max_data_blocks){
+    size_t meta = sizeof(fs_info_block) + INODE_SIZE + bitmap_bytes(max_inodes) + bitmap_bytes(max_data_blocks) + block_summary_bytes(max_data_blocks) + BLOCK_SIZE - 1 + journal_blocks(max_inodes) * BLOCK_SIZE + max_inodes * INODE_SIZE;
+    return (meta + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+/**
+ * Hash of an entry name (FNV-1a)
+*/
+static uint32_t name_hash(const char *name, size_t name_len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Bytes taken by a directory entry with a name of name_len chars, kept
+ * 8 byte aligned
+*/
+static size_t dir_entry_len(size_t name_len) {
+    return (offsetof(directory_entry, name) + name_len + 1 + 7) & ~(size_t)7;
+}
+
+/**
+ * Fill in everything of a directory entry but its rec_len
+*/
+static void fill_dir_entry(directory_entry *entry, const char *name, size_t name_len, size_t inode_offset) {
+    entry->inode_offset = inode_offset;
+    entry->hash = name_hash(name, name_len);
+    entry->name_len = name_len;
+    memcpy(entry->name, name, name_len);
+    entry->name[name_len] = '\0';
+}
+
+/**
+ * Allocate the dentry cache of a mount, empty, sized for the inode count
+ */
+static int init_dcache(void *fsptr, size_t fssize, fs_context *ctx){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    size_t sets = dcache_sets(info_block->max_inodes);
+    size_t bytes = sets * DCACHE_WAYS * sizeof(dcache_entry);
+    void *entries;
+    if (posix_memalign(&entries, DCACHE_ALIGN, bytes)) return -1;
+    memset(entries, 0, bytes);
+    ctx->dcache = (dcache_entry*)entries;
+    ctx->dcache_sets = sets;
+    for (int i = 0; i < DCACHE_STRIPES; i++) {
+        dcache_stripe *stripe = &ctx->dcache_stripes[i];
+        stripe->tick = 0;
+        stripe->hits = stripe->negative_hits = stripe->misses = 0;
+    }
+    return 0;
+}
+
+/**
+ * Set of the dentry cache that may hold a directory's entry, and the stripe
+ * guarding it
+ */
+static dcache_entry* dcache_set(void *fsptr, size_t fssize, fs_context *ctx, size_t dir_offset, uint32_t hash, dcache_stripe **stripe_ptr){
+    size_t set = (hash ^ (dir_offset / INODE_SIZE * 0x9E3779B1u)) & (ctx->dcache_sets - 1);
+    *stripe_ptr = &ctx->dcache_stripes[set % DCACHE_STRIPES];
+    return &ctx->dcache[set * DCACHE_WAYS];
+}
+
+/**
+ * Entry of a set caching the lookup of name in a directory, NULL if none
+ */
+static dcache_entry* dcache_find(dcache_entry *set, size_t dir_offset, uint32_t dir_generation, const char *name, size_t name_len, uint32_t hash){
+    for (int way = 0; way < DCACHE_WAYS; way++) {
+        dcache_entry *entry = &set[way];
+        if (entry->dir_offset == dir_offset && entry->dir_generation == dir_generation && entry->hash == hash &&
+            entry->name_len == name_len && !memcmp(entry->name, name, name_len)) return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Inode the entry name of a directory points to if the lookup is cached,
+ * 0 if it is cached as missing and (size_t)-1 if not cached. The caller
+ * holds the directory locked.
+ */
+static size_t dcache_lookup(void *fsptr, size_t fssize, fs_context *ctx, size_t dir_offset, uint32_t dir_generation, const char *name, size_t name_len, uint32_t hash){
+    dcache_stripe *stripe;
+    dcache_entry *set = dcache_set(fsptr, fssize, ctx, dir_offset, hash, &stripe);
+    if (!set) return (size_t)-1;
+
+    size_t inode_offset = (size_t)-1;
+    pthread_mutex_lock(&stripe->lock);
+    dcache_entry *entry = (name_len <= DCACHE_NAME_MAX) ? dcache_find(set, dir_offset, dir_generation, name, name_len, hash) : NULL;
+    if (entry) {
+        entry->last_used = ++stripe->tick;
+        inode_offset = entry->inode_offset;
+        stripe->hits++;
+        if (!inode_offset) stripe->negative_hits++;
+    } else {
+        stripe->misses++;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return inode_offset;
+}
+
+/**
+ * Cache that the entry name of a directory points to inode_offset, or is
+ * missing if inode_offset is 0, in place
+ * of the least recently used entry of its set. The caller holds the
+ * directory locked, so the entry can't change before this is cached.
+ */
+static void dcache_insert(void *fsptr, size_t fssize, fs_context *ctx, size_t dir_offset, uint32_t dir_generation, const char *name, size_t name_len, uint32_t hash, size_t inode_offset){
+    if (name_len > DCACHE_NAME_MAX) return;
+    dcache_stripe *stripe;
+    dcache_entry *set = dcache_set(fsptr, fssize, ctx, dir_offset, hash, &stripe);
+    if (!set) return;
+
+    pthread_mutex_lock(&stripe->lock);
+    dcache_entry *entry = dcache_find(set, dir_offset, dir_generation, name, name_len, hash);
+    if (!entry) {
+        /*A free entry, else the one unused the longest (ticks wrap)*/
+        entry = &set[0];
+        for (int way = 0; way < DCACHE_WAYS && entry->dir_offset; way++) {
+            if (!set[way].dir_offset || (int32_t)(set[way].last_used - entry->last_used) < 0) entry = &set[way];
+        }
+        entry->dir_offset = dir_offset;
+        entry->dir_generation = dir_generation;
+        entry->hash = hash;
+        entry->name_len = name_len;
+        memcpy(entry->name, name, name_len);
+        entry->name[name_len] = '\0';
+    }
+    entry->inode_offset = inode_offset;
+    entry->last_used = ++stripe->tick;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/**
+ * Drop the cached lookup of name in a directory. The caller holds the
+ * directory locked exclusive, so no lookup caches the old entry again.
+ */
+static void dcache_forget(void *fsptr, size_t fssize, fs_context *ctx, size_t dir_offset, uint32_t dir_generation, const char *name){
+    size_t name_len = strnlen(name, MAX_FILENAME);
+    if (name_len > DCACHE_NAME_MAX) return;
+    uint32_t hash = name_hash(name, name_len);
+    dcache_stripe *stripe;
+    dcache_entry *set = dcache_set(fsptr, fssize, ctx, dir_offset, hash, &stripe);
+    if (!set) return;
+
+    pthread_mutex_lock(&stripe->lock);
+    dcache_entry *entry = dcache_find(set, dir_offset, dir_generation, name, name_len, hash);
+    if (entry) entry->dir_offset = 0;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/**
+ * Init the fs
+ */
+static int init_fs(void *fsptr, size_t fssize, fs_context *ctx){
+    /*Info block at beggining of file system*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    
+    /*Nothing works without the mount's locks*/
+    if (!ctx) return 0;
+
+    /*FS already init, refuse images laid out by another version*/
+    if(info_block->fs_id == FS_ID) return info_block->version == FS_VERSION;
+
+    /*Size the inode table from fssize*/
+    size_t max_inodes = fssize / BYTES_PER_INODE;
+    if (max_inodes < MIN_INODES) max_inodes = MIN_INODES;
+
+    /*Give the rest to data blocks, minus what their bitmap eats*/
+    size_t max_data_blocks = 0, base = data_blocks_offset(max_inodes, 0);
+    if (base < fssize) max_data_blocks = (fssize - base) / BLOCK_SIZE;
+    while (max_data_blocks && data_blocks_offset(max_inodes, max_data_blocks) + max_data_blocks * BLOCK_SIZE > fssize) max_data_blocks--;
+
+    /*Too small to even hold the root dir*/
+    if (!max_data_blocks) return 0;
+
+    /*Init info block of fs*/
+    info_block->fs_id = FS_ID;
+    info_block->version = FS_VERSION;
+    info_block->size = fssize;
+    info_block->root_inode = sizeof(fs_info_block);
+    info_block->free_inode_bitmap = info_block->root_inode + INODE_SIZE;
+    info_block->free_block_bitmap = info_block->free_inode_bitmap + bitmap_bytes(max_inodes);
+    info_block->block_summary[0] = info_block->free_block_bitmap + bitmap_bytes(max_data_blocks);
+    for (int level = 1; level < SUMMARY_LEVELS; level++) info_block->block_summary[level] = info_block->block_summary[level - 1] + bitmap_bytes(block_map_bits(max_data_blocks, level));
+    info_block->journal = (info_block->block_summary[SUMMARY_LEVELS - 1] + bitmap_bytes(block_map_bits(max_data_blocks, SUMMARY_LEVELS)) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    info_block->journal_blocks = journal_blocks(max_inodes);
+    info_block->inode_table = info_block->journal + info_block->journal_blocks * BLOCK_SIZE;
+    info_block->data_blocks = data_blocks_offset(max_inodes, max_data_blocks);
+    info_block->max_data_blocks = max_data_blocks;
+    info_block->max_inodes = max_inodes;
+    info_block->free_blocks = max_data_blocks;
+    info_block->free_inodes = max_inodes;
+
+    /*Empty journal*/
+    journal_header *header = get_journal(fsptr, fssize);
+    memset(header, 0, 2 * BLOCK_SIZE);
+    header->magic = JOURNAL_MAGIC;
+    header->tail_seq = 1;
+
+    /*Init root*/
+    inode *root = (inode*)offset_to_ptr(fsptr, fssize, info_block->root_inode);
+    if (!root) return 0;
+    memset(root, 0, sizeof(inode));
+    root->mode = S_IFDIR | 0755;
+    root->uid = getuid();
+    root->gid = getgid();
+    root->size = 0;
+    root->access_time = root->modification_time = root->change_time = time(NULL);
+    root->num_extents = 1;
+    root->extents[0].start = 0;
+    root->extents[0].count = 1;
+
+    /*Init root dir*/
+    char *root_dir = (char*)offset_to_ptr(fsptr, fssize, info_block->data_blocks);
+    /*Add .*/
+    directory_entry *dot = (directory_entry*)root_dir;
+    fill_dir_entry(dot, ".", 1, info_block->root_inode);
+    dot->rec_len = dir_entry_len(1);
+    /*Add .., it owns the rest of the block*/
+    directory_entry *dotdot = (directory_entry*)(root_dir + dot->rec_len);
+    fill_dir_entry(dotdot, "..", 2, info_block->root_inode);
+    dotdot->rec_len = BLOCK_SIZE - dot->rec_len;
+    root->size = BLOCK_SIZE;
+    root->num_entries = 2;
+    root->nlink = 2;
+
+    /*Init inode bitmap*/
+    memset(offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap), 0, bitmap_bytes(max_inodes));
+
+    /*Mark root as used*/
+    mark_inode_used(fsptr, fssize, ctx, 0);
+
+    /*Init data block bitmap and its summaries. Padding past the last real
+      bit of each level counts as used, so it never looks free.*/
+    for (int level = 0; level <= SUMMARY_LEVELS; level++) {
+        uint8_t *map = (uint8_t*)block_map_level(fsptr, fssize, level);
+        size_t nbits = block_map_bits(max_data_blocks, level), nbytes = bitmap_bytes(nbits);
+        memset(map, 0, nbytes);
+        for (size_t n = nbits; n < nbytes * 8; n++) map[n / 8] |= 1 << (n % 8);
+    }
+    
+    /*Mark root's data block as used*/
+    mark_block_used(fsptr, fssize, ctx, 0);
+
+    /*FS is init. Yay*/
+    return 1;
+}
+
+/**
+ * Find free data block
+*/
+static size_t find_free_data_block(void *fsptr, size_t fssize, fs_context *ctx) {
+    /*Get the info block*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    /*Scan the small top summary level for a word that isn't full*/
+    uint64_t *top = block_map_level(fsptr, fssize, SUMMARY_LEVELS);
+    if (!top) return (size_t)-1;
+    lock_alloc(fsptr, fssize, ctx);
+    size_t block_num = bitmap_find_clear(top, block_map_bits(info_block->max_data_blocks, SUMMARY_LEVELS));
+
+    /*Then follow a clear bit down, one word per level*/
+    for (int level = SUMMARY_LEVELS - 1; level >= 0 && block_num != (size_t)-1; level--) {
+        uint64_t *map = block_map_level(fsptr, fssize, level);
+        if (!map) block_num = (size_t)-1;
+        else {
+            uint64_t word = bitmap_word(map, block_num);
+            block_num = (word == UINT64_MAX) ? (size_t)-1 : block_num * 64 + __builtin_ctzll(~word);
+        }
+    }
+
+    /*No free data blocks, critical failure, oh no!, it's gonna blow up!*/
+    if (block_num >= info_block->max_data_blocks) {
+        unlock_alloc(fsptr, fssize, ctx);
+        return (size_t)-1;
+    }
+
+    /*Mark block as used*/
+    mark_block_used(fsptr, fssize, ctx, block_num);
+    unlock_alloc(fsptr, fssize, ctx);
+
+    /*Calculate block offset*/
+    return info_block->data_blocks + block_num * BLOCK_SIZE;
+}
+
+
+/**
+ * Frees data block and updates bitmap 
+*/
+static int free_data_block(void *fsptr, size_t fssize, fs_context *ctx, size_t block_offset) {
+    /*Get the info block*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    /*Check if block offset is valid*/
+    if (block_offset < info_block->data_blocks || block_offset >= fssize) return -1;
+    
+    /*Calculate block number*/
+    size_t block_num = (block_offset - info_block->data_blocks) / BLOCK_SIZE;
+    if (block_num >= info_block->max_data_blocks) return -1;
+    
+    /*Free the block*/
+    lock_alloc(fsptr, fssize, ctx);
+    mark_block_free(fsptr, fssize, ctx, block_num);
+    unlock_alloc(fsptr, fssize, ctx);
+    return 0;
+}
+
+/**
+ * Marks a specific data block as used if it is free
+*/
+static int claim_data_block(void *fsptr, size_t fssize, fs_context *ctx, size_t block_num) {
+    /*Get the info block*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    if (block_num >= info_block->max_data_blocks) return -1;
+
+    /*Block must fit in the fs*/
+    if (info_block->data_blocks + (block_num + 1) * BLOCK_SIZE > fssize) return -1;
+
     /*Get the bitmap*/
     uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_block_bitmap);
     if (!bitmap) return -1;
+
+    /*Taken already*/
+    lock_alloc(fsptr, fssize, ctx);
+    if (bitmap[block_num / 8] & (1 << (block_num % 8))) {
+        unlock_alloc(fsptr, fssize, ctx);
+        return -1;
+    }
+
+    /*Mark block as used*/
+    mark_block_used(fsptr, fssize, ctx, block_num);
+    unlock_alloc(fsptr, fssize, ctx);
+    return 0;
+}
+
+/**
+ * Number of data blocks needed to hold size bytes
+*/
+static size_t size_to_blocks(size_t size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * Get the index-th extent of a file, inline or in the overflow block
+*/
+static extent* get_extent(void *fsptr, size_t fssize, inode *node, size_t index) {
+    /*Inline extent*/
+    if (index < INLINE_EXTENTS) return &node->extents[index];
+
+    /*Overflow extent*/
+    if (!node->extent_block || index >= MAX_EXTENTS) return NULL;
+    extent *overflow = (extent*)offset_to_ptr(fsptr, fssize, node->extent_block);
+    return overflow ? &overflow[index - INLINE_EXTENTS] : NULL;
+}
+
+/**
+ * Note that a node's extents changed, inline and in the overflow block
+*/
+static void log_extents(void *fsptr, size_t fssize, fs_context *ctx, inode *node) {
+    log_meta(fsptr, fssize, ctx, node, INODE_SIZE);
+    extent *overflow = node->extent_block ? (extent*)offset_to_ptr(fsptr, fssize, node->extent_block) : NULL;
+    if (overflow && node->num_extents > INLINE_EXTENTS) log_meta(fsptr, fssize, ctx, overflow, (node->num_extents - INLINE_EXTENTS) * sizeof(extent));
+}
+
+/**
+ * Map a block of a file to its offset in the fs. *run gets the number of
+ * contiguous blocks starting there (at least 1), 0 is returned if unmapped.
+*/
+static size_t map_block(void *fsptr, size_t fssize, inode *node, size_t block, size_t *run) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+
+    /*Walk extents until we hit the one holding the block*/
+    for (size_t i = 0; i < node->num_extents; i++) {
+        extent *ext = get_extent(fsptr, fssize, node, i);
+        if (!ext) return 0;
+        if (block < ext->count) {
+            size_t block_offset = info_block->data_blocks + ((size_t)ext->start + block) * BLOCK_SIZE;
+            if (block_offset >= fssize) return 0;
+
+            /*Clamp run to what is actually inside the fs*/
+            *run = ext->count - block;
+            if (*run > (fssize - block_offset) / BLOCK_SIZE) *run = (fssize - block_offset) / BLOCK_SIZE;
+            return *run ? block_offset : 0;
+        }
+        block -= ext->count;
+    }
+
+    /*Past the end of the file*/
+    return 0;
+}
+
+/**
+ * Free blocks at the end of a file until only keep of its have blocks remain
+*/
+static void shrink_inode(void *fsptr, size_t fssize, fs_context *ctx, inode *node, size_t have, size_t keep) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    size_t excess = (have > keep) ? have - keep : 0;
+
+    /*Eat extents from the back*/
+    while (excess && node->num_extents) {
+        extent *last = get_extent(fsptr, fssize, node, node->num_extents - 1);
+        if (!last) break;
+        while (excess && last->count) {
+            last->count--;
+            free_data_block(fsptr, fssize, ctx, info_block->data_blocks + ((size_t)last->start + last->count) * BLOCK_SIZE);
+            excess--;
+        }
+        if (!last->count) node->num_extents--;
+    }
+
+    /*Overflow block no longer needed*/
+    if (node->num_extents <= INLINE_EXTENTS && node->extent_block) {
+        free_data_block(fsptr, fssize, ctx, node->extent_block);
+        node->extent_block = 0;
+    }
+    log_extents(fsptr, fssize, ctx, node);
+}
+
+/**
+ * Append blocks to a file until it has want blocks. New blocks are taken
+ * right after the last extent when possible so runs stay contiguous.
+*/
+static int grow_inode(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, inode *node, size_t have, size_t want) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+
+    for (size_t n = have; n < want; n++) {
+        /*Try to extend the last run*/
+        extent *last = node->num_extents ? get_extent(fsptr, fssize, node, node->num_extents - 1) : NULL;
+        if (last && last->count < UINT32_MAX && !claim_data_block(fsptr, fssize, ctx, (size_t)last->start + last->count)) {
+            last->count++;
+            continue;
+        }
+
+        /*Out of extents, file is as big as it gets*/
+        if (node->num_extents >= MAX_EXTENTS) {
+            shrink_inode(fsptr, fssize, ctx, node, n, have);
+            *errnoptr = EFBIG;
+            return -1;
+        }
+
+        /*Need the overflow block for this extent*/
+        if (node->num_extents == INLINE_EXTENTS && !node->extent_block) {
+            size_t extent_block = find_free_data_block(fsptr, fssize, ctx);
+            if (extent_block == (size_t)-1) {
+                shrink_inode(fsptr, fssize, ctx, node, n, have);
+                *errnoptr = ENOSPC;
+                return -1;
+            }
+            node->extent_block = extent_block;
+        }
+
+        /*Start a new run*/
+        size_t block_offset = find_free_data_block(fsptr, fssize, ctx);
+        if (block_offset == (size_t)-1 || block_offset + BLOCK_SIZE > fssize) {
+            if (block_offset != (size_t)-1) free_data_block(fsptr, fssize, ctx, block_offset);
+            shrink_inode(fsptr, fssize, ctx, node, n, have);
+            *errnoptr = ENOSPC;
+            return -1;
+        }
+        extent *ext = get_extent(fsptr, fssize, node, node->num_extents);
+        if (!ext) {
+            free_data_block(fsptr, fssize, ctx, block_offset);
+            shrink_inode(fsptr, fssize, ctx, node, n, have);
+            *errnoptr = EIO;
+            return -1;
+        }
+        ext->start = (block_offset - info_block->data_blocks) / BLOCK_SIZE;
+        ext->count = 1;
+        node->num_extents++;
+    }
+
+    log_extents(fsptr, fssize, ctx, node);
+    return 0;
+}
+
+/**
+ * Copy len bytes at pos of a file out to dst, in from src, or zero
+ * them if both are NULL. One memcpy per contiguous run.
+*/
+static int inode_rw(void *fsptr, size_t fssize, fs_context *ctx, inode *node, size_t pos, size_t len, char *dst, const char *src) {
+    while (len) {
+        /*Find run holding pos*/
+        size_t run;
+        size_t block_offset = map_block(fsptr, fssize, node, pos / BLOCK_SIZE, &run);
+        if (!block_offset) return -1;
+
+        /*Clip to the run*/
+        size_t in_block = pos % BLOCK_SIZE;
+        size_t chunk = run * BLOCK_SIZE - in_block;
+        if (chunk > len) chunk = len;
+        char *data = (char*)fsptr + block_offset + in_block;
+
+        /*Move the bytes*/
+        if (dst) {
+            memcpy(dst, data, chunk);
+            dst += chunk;
+        } else if (src) {
+            memcpy(data, src, chunk);
+            src += chunk;
+            mark_dirty_ptr(fsptr, fssize, ctx, data, chunk);
+        } else {
+            memset(data, 0, chunk);
+            mark_dirty_ptr(fsptr, fssize, ctx, data, chunk);
+        }
+        pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Mark len bytes at pos of a file dirty, a run at a time
+*/
+static void mark_file_dirty(void *fsptr, size_t fssize, fs_context *ctx, inode *node, size_t pos, size_t len) {
+    while (len) {
+        size_t run;
+        size_t block_offset = map_block(fsptr, fssize, node, pos / BLOCK_SIZE, &run);
+        if (!block_offset) return;
+
+        size_t chunk = run * BLOCK_SIZE - pos % BLOCK_SIZE;
+        if (chunk > len) chunk = len;
+        mark_dirty(fsptr, fssize, ctx, block_offset + pos % BLOCK_SIZE, chunk);
+        pos += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * Describe len bytes at pos of a file as the runs of the image holding
+ * them, one iovec per run. Returns the number of runs, or -1 if the
+ * file's extents don't cover the range or there are more than max.
+*/
+static int inode_map(void *fsptr, size_t fssize, inode *node, size_t pos, size_t len, struct iovec *iov, int max) {
+    int count = 0;
+    while (len) {
+        /*Find run holding pos*/
+        size_t run;
+        size_t block_offset = map_block(fsptr, fssize, node, pos / BLOCK_SIZE, &run);
+        if (!block_offset || count == max) return -1;
+
+        /*Clip to the run*/
+        size_t in_block = pos % BLOCK_SIZE;
+        size_t chunk = run * BLOCK_SIZE - in_block;
+        if (chunk > len) chunk = len;
+        iov[count].iov_base = (char*)fsptr + block_offset + in_block;
+        iov[count].iov_len = chunk;
+        count++;
+        pos += chunk;
+        len -= chunk;
+    }
+    return count;
+}
+
+/**
+ * Hand len bytes at pos of a file to fn as runs of the image. Returns
+ * what fn returns, or a negative errno value if the runs can't be mapped.
+*/
+static ssize_t inode_map_call(void *fsptr, size_t fssize, inode *node, size_t pos, size_t len, run_callback fn, void *arg) {
+    /*A range never spans more runs than the file has extents*/
+    struct iovec stack_iov[STACK_RUNS];
+    struct iovec *iov = stack_iov;
+    int max = STACK_RUNS;
+    if (node->num_extents > STACK_RUNS) {
+        max = node->num_extents;
+        iov = malloc(max * sizeof(struct iovec));
+        if (!iov) return -ENOMEM;
+    }
+
+    ssize_t res;
+    int count = inode_map(fsptr, fssize, node, pos, len, iov, max);
+    res = (count < 0) ? -EIO : fn(arg, iov, count);
+
+    if (iov != stack_iov) free(iov);
+    return res;
+}
+
+/**
+ * Run callback copying out to the buffer arg
+*/
+static ssize_t copy_from_runs(void *arg, const struct iovec *iov, int count) {
+    char *dst = (char*)arg;
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(dst + total, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/**
+ * Run callback copying in from the buffer arg
+*/
+static ssize_t copy_to_runs(void *arg, const struct iovec *iov, int count) {
+    const char *src = (const char*)arg;
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(iov[i].iov_base, src + total, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/**
+ * Next component of the first path_len bytes of path, slashes skipped.
+ * *pos is where to look from and moves past the component. Returns the
+ * component's length, 0 at the end. Nothing is copied, *component points
+ * into path.
+ */
+static size_t next_component(const char *path, size_t path_len, size_t *pos, const char **component) {
+    while (*pos < path_len && path[*pos] == '/') (*pos)++;
+    *component = path + *pos;
+    while (*pos < path_len && path[*pos] != '/') (*pos)++;
+    return path + *pos - *component;
+}
+
+/**
+ * Split path into parent dir and base name without copying. The parent is
+ * the first *parent_len bytes of path, the base name is the rest of it
+ * behind the last slash.
+ */
+static int split_path(const char *path, size_t *parent_len, const char **base_name) {
+    /*Empty directory*/
+    if (!path || !parent_len || !base_name) return -1;
+
+    /*Find last slash, invalid path without one*/
+    const char *last_slash = strrchr(path, '/');
+    if (last_slash == NULL) return -1;
+
+    *parent_len = last_slash - path;
+    *base_name = last_slash + 1;
+    return 0;
+}
+
+/*Find a free inode*/
+static size_t find_free_inode(void *fsptr, size_t fssize, fs_context *ctx) {
+    /*Make info block*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    /*Get offset to ptr for start of bitmap*/
+    uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
+    if (!bitmap) return (size_t)-1;
+
+    /*First free iNode, by Apple™, a word at a time*/
+    lock_alloc(fsptr, fssize, ctx);
+    size_t inode_num = bitmap_find_clear((const uint64_t*)bitmap, info_block->max_inodes);
+
+    /*You have failed me Anakin*/
+    if (inode_num == (size_t)-1) {
+        unlock_alloc(fsptr, fssize, ctx);
+        return (size_t)-1;
+    }
+
+    /*Mark iNode, by Apple™, as used*/
+    mark_inode_used(fsptr, fssize, ctx, inode_num);
+    unlock_alloc(fsptr, fssize, ctx);
+
+    /*Calculate offset to iNode, by Apple™. The caller fills it in under
+      its parent's exclusive lock, so it can be marked now.*/
+    size_t inode_offset = info_block->inode_table + inode_num * INODE_SIZE;
+    log_meta(fsptr, fssize, ctx, (char*)fsptr + inode_offset, INODE_SIZE);
+    return inode_offset;
+}
+
+/**
+ * Clear an inode, all but its generation
+*/
+static void reset_inode(inode *node) {
+    memset(node, 0, offsetof(inode, generation));
+}
+
+/**
+ * Give an inode back to the inode bitmap and clear it
+*/
+static void release_inode(void *fsptr, size_t fssize, fs_context *ctx, size_t inode_offset) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+
+    /*Reset inode first, it may be handed out again as soon as it's unmarked*/
+    inode *node = (inode*)offset_to_ptr(fsptr, fssize, inode_offset);
+    if (node) {
+        reset_inode(node);
+        node->generation++;
+        log_meta(fsptr, fssize, ctx, node, INODE_SIZE);
+    }
+    time_t *pending = lazy_atime(fsptr, fssize, ctx, inode_offset);
+    if (pending) __atomic_store_n(pending, 0, __ATOMIC_RELAXED);
+
+    /*Unmark inode in bitmap*/
+    if (inode_offset >= info_block->inode_table) {
+        lock_alloc(fsptr, fssize, ctx);
+        mark_inode_free(fsptr, fssize, ctx, (inode_offset - info_block->inode_table) / INODE_SIZE);
+        unlock_alloc(fsptr, fssize, ctx);
+    }
+}
+
+/**
+ * Get the directory entry at byte pos of a directory
+*/
+static directory_entry* get_dir_entry(void *fsptr, size_t fssize, inode *dir_inode, size_t pos) {
+    size_t run;
+    size_t block_offset = map_block(fsptr, fssize, dir_inode, pos / BLOCK_SIZE, &run);
+    return block_offset ? (directory_entry*)((char*)fsptr + block_offset + pos % BLOCK_SIZE) : NULL;
+}
+
+/**
+ * Check that an entry at byte off of its block has a sane rec_len
+*/
+static int dir_entry_ok(directory_entry *entry, size_t off) {
+    return entry->rec_len >= sizeof(directory_entry) && entry->rec_len % 8 == 0 && off + entry->rec_len <= BLOCK_SIZE;
+}
+
+/**
+ * Find the entry in front of the one at byte off of a directory block,
+ * NULL for the block's first. Returns -1 if no entry starts at off.
+*/
+static int prev_dir_entry(char *block, size_t off, directory_entry **prev) {
+    size_t at = 0;
+    *prev = NULL;
+    while (at < off) {
+        *prev = (directory_entry*)(block + at);
+        if (!dir_entry_ok(*prev, at)) return -1;
+        at += (*prev)->rec_len;
+    }
+    return (at == off) ? 0 : -1;
+}
+
+/**
+ * Get the next used entry at or after byte *pos of a directory and move
+ * *pos past it, NULL once the directory is done. Entries never straddle
+ * blocks, so a block is walked by rec_len alone.
+*/
+static directory_entry* next_dir_entry(void *fsptr, size_t fssize, inode *dir_inode, size_t *pos) {
+    while (*pos < dir_inode->size) {
+        size_t base = *pos / BLOCK_SIZE * BLOCK_SIZE;
+        char *block = (char*)get_dir_entry(fsptr, fssize, dir_inode, base);
+        if (!block) return NULL;
+
+        for (size_t off = *pos - base; off < BLOCK_SIZE; ) {
+            directory_entry *entry = (directory_entry*)(block + off);
+            if (!dir_entry_ok(entry, off)) return NULL;
+            off += entry->rec_len;
+            if (entry->inode_offset) {
+                *pos = base + off;
+                return entry;
+            }
+        }
+        *pos = base + BLOCK_SIZE;
+    }
+    return NULL;
+}
+
+/**
+ * Get a slot of a directory hash index. The table lives in the blocks of
+ * a hidden inode, so it grows with the same extent code as files.
+*/
+static dir_index_slot* index_slot(void *fsptr, size_t fssize, inode *index, size_t slot) {
+    size_t run, pos = slot * sizeof(dir_index_slot);
+    size_t block_offset = map_block(fsptr, fssize, index, pos / BLOCK_SIZE, &run);
+    return block_offset ? (dir_index_slot*)((char*)fsptr + block_offset + pos % BLOCK_SIZE) : NULL;
+}
+
+/**
+ * Put the entry at byte entry with the given hash in the first free slot
+*/
+static int index_insert(void *fsptr, size_t fssize, fs_context *ctx, inode *index, uint32_t hash, size_t entry) {
+    if (entry >= UINT32_MAX) return -1;
+    size_t mask = index->size / sizeof(dir_index_slot) - 1, slot = hash & mask;
+
+    /*Probe until we hit a hole*/
+    for (size_t probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        dir_index_slot *s = index_slot(fsptr, fssize, index, slot);
+        if (!s) return -1;
+        if (!s->entry) {
+            s->hash = hash;
+            s->entry = entry + 1;
+            mark_dirty_ptr(fsptr, fssize, ctx, s, sizeof(*s));
+            return 0;
+        }
+    }
+
+    /*Table full, should never happen below 3/4 load*/
+    return -1;
+}
+
+/**
+ * Find the slot pointing at the entry at byte entry, (size_t)-1 if none does
+*/
+static size_t index_find_slot(void *fsptr, size_t fssize, inode *index, uint32_t hash, size_t entry) {
+    size_t mask = index->size / sizeof(dir_index_slot) - 1, slot = hash & mask;
+
+    for (size_t probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        dir_index_slot *s = index_slot(fsptr, fssize, index, slot);
+        if (!s || !s->entry) return (size_t)-1;
+        if (s->hash == hash && s->entry == entry + 1) return slot;
+    }
+    return (size_t)-1;
+}
+
+/**
+ * Drop the entry at byte entry from the index. Later slots of the cluster are
+ * shifted back into the hole so no tombstones are needed.
+*/
+static int index_remove(void *fsptr, size_t fssize, fs_context *ctx, inode *index, uint32_t hash, size_t entry) {
+    size_t mask = index->size / sizeof(dir_index_slot) - 1;
+    size_t hole = index_find_slot(fsptr, fssize, index, hash, entry);
+    if (hole == (size_t)-1) return -1;
+
+    /*Backward shift deletion*/
+    for (size_t slot = (hole + 1) & mask; slot != hole; slot = (slot + 1) & mask) {
+        dir_index_slot *s = index_slot(fsptr, fssize, index, slot);
+        if (!s) return -1;
+        if (!s->entry) break;
+
+        /*Slot can fill the hole if the hole lies between its home and itself*/
+        size_t home = s->hash & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            dir_index_slot *h = index_slot(fsptr, fssize, index, hole);
+            if (!h) return -1;
+            *h = *s;
+            mark_dirty_ptr(fsptr, fssize, ctx, h, sizeof(*h));
+            hole = slot;
+        }
+    }
+
+    /*Clear the final hole*/
+    dir_index_slot *h = index_slot(fsptr, fssize, index, hole);
+    if (!h) return -1;
+    h->entry = 0;
+    mark_dirty_ptr(fsptr, fssize, ctx, h, sizeof(*h));
+    return 0;
+}
+
+/**
+ * Note that a directory's hash index changed. Its slots aren't logged, a
+ * redo builds the index again from the entries.
+*/
+static void log_reindex(void *fsptr, size_t fssize, fs_context *ctx, inode *dir_inode) {
+    journal_txn *txn = journal_txn_get(fsptr, fssize, ctx);
+    if (txn && dir_inode->dir_index) journal_add(txn, JOURNAL_REINDEX, 0, (char*)dir_inode - (char*)fsptr, 0, UINT64_MAX);
+}
+
+/**
+ * Free the hash index of a directory, it falls back to linear scans
+*/
+static void drop_dir_index(void *fsptr, size_t fssize, fs_context *ctx, inode *dir_inode) {
+    if (!dir_inode->dir_index) return;
+    inode *index = (inode*)offset_to_ptr(fsptr, fssize, dir_inode->dir_index);
+    if (index) shrink_inode(fsptr, fssize, ctx, index, size_to_blocks(index->size), 0);
+    release_inode(fsptr, fssize, ctx, dir_inode->dir_index);
+    dir_inode->dir_index = 0;
+}
+
+/**
+ * Free a file or an empty directory whose entry is already gone
+*/
+static void destroy_inode(void *fsptr, size_t fssize, fs_context *ctx, size_t inode_offset) {
+    inode *node = (inode*)offset_to_ptr(fsptr, fssize, inode_offset);
+    if (!node) return;
+    drop_dir_index(fsptr, fssize, ctx, node);
+    shrink_inode(fsptr, fssize, ctx, node, size_to_blocks(node->size), 0);
+    release_inode(fsptr, fssize, ctx, inode_offset);
+}
+
+/**
+ * Open count of the node at inode_offset, NULL for the root, which is
+ * never opened as a file
+*/
+static uint32_t* open_count(void *fsptr, size_t fssize, fs_context *ctx, size_t inode_offset) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    if (!ctx->open_counts || inode_offset < info_block->inode_table) return NULL;
+    return &ctx->open_counts[(inode_offset - info_block->inode_table) / INODE_SIZE];
+}
+
+/**
+ * Free a node whose last entry is gone, unless descriptors are still open
+ * on it. It is kept with nlink 0 then, for them to read, write and sync,
+ * and freed when the last is released. The caller holds it exclusive,
+ * which opens take shared.
+*/
+static void unlink_inode(void *fsptr, size_t fssize, fs_context *ctx, size_t inode_offset) {
+    inode *node = (inode*)offset_to_ptr(fsptr, fssize, inode_offset);
+    uint32_t *count = open_count(fsptr, fssize, ctx, inode_offset);
+    if (!node || !count || !__atomic_load_n(count, __ATOMIC_RELAXED)) {
+        destroy_inode(fsptr, fssize, ctx, inode_offset);
+        return;
+    }
+    node->nlink = 0;
+    node->change_time = time(NULL);
+    log_meta(fsptr, fssize, ctx, node, INODE_SIZE);
+}
+
+/**
+ * (Re)build the hash index of a directory, sized so it stays at most 3/4 full
+*/
+static int build_dir_index(void *fsptr, size_t fssize, fs_context *ctx, inode *dir_inode) {
+    size_t num_entries = dir_inode->num_entries;
+    int err;
+
+    /*Power of two number of slots*/
+    size_t nslots = DIR_INDEX_MIN_SLOTS;
+    while (nslots * 3 < num_entries * 4) nslots *= 2;
+
+    /*Hidden inode holding the table*/
+    if (!dir_inode->dir_index) {
+        size_t index_offset = find_free_inode(fsptr, fssize, ctx);
+        if (index_offset == (size_t)-1) return -1;
+        inode *index = (inode*)offset_to_ptr(fsptr, fssize, index_offset);
+        if (!index) {
+            release_inode(fsptr, fssize, ctx, index_offset);
+            return -1;
+        }
+        reset_inode(index);
+        index->mode = S_IFREG;
+        index->access_time = index->modification_time = index->change_time = time(NULL);
+        dir_inode->dir_index = index_offset;
+    }
+    inode *index = (inode*)offset_to_ptr(fsptr, fssize, dir_inode->dir_index);
+    if (!index) {
+        dir_inode->dir_index = 0;
+        return -1;
+    }
+
+    /*Resize and clear the table*/
+    size_t have = size_to_blocks(index->size), want = size_to_blocks(nslots * sizeof(dir_index_slot));
+    if (want > have && grow_inode(fsptr, fssize, ctx, &err, index, have, want)) {
+        drop_dir_index(fsptr, fssize, ctx, dir_inode);
+        return -1;
+    }
+    shrink_inode(fsptr, fssize, ctx, index, have, want);
+    index->size = nslots * sizeof(dir_index_slot);
+    if (inode_rw(fsptr, fssize, ctx, index, 0, index->size, NULL, NULL)) {
+        drop_dir_index(fsptr, fssize, ctx, dir_inode);
+        return -1;
+    }
+
+    /*Hash every entry in, entries carry their hash already*/
+    size_t pos = 0, found = 0;
+    directory_entry *entry;
+    while ((entry = next_dir_entry(fsptr, fssize, dir_inode, &pos))) {
+        if (index_insert(fsptr, fssize, ctx, index, entry->hash, pos - entry->rec_len)) break;
+        found++;
+    }
+    if (found != num_entries) {
+        drop_dir_index(fsptr, fssize, ctx, dir_inode);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Find the byte position of the entry whose name is the name_len bytes at
+ * name in a directory, (size_t)-1 if missing. Indexed directories take one
+ * probe sequence, others are scanned.
+*/
+static size_t find_dir_entry(void *fsptr, size_t fssize, inode *dir_inode, const char *name, size_t name_len) {
+    uint32_t hash = name_hash(name, name_len);
+
+    /*Hashed lookup*/
+    inode *index = dir_inode->dir_index ? (inode*)offset_to_ptr(fsptr, fssize, dir_inode->dir_index) : NULL;
+    if (index) {
+        size_t mask = index->size / sizeof(dir_index_slot) - 1, slot = hash & mask;
+        for (size_t probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+            dir_index_slot *s = index_slot(fsptr, fssize, index, slot);
+            if (!s || !s->entry) return (size_t)-1;
+            if (s->hash != hash) continue;
+            directory_entry *entry = get_dir_entry(fsptr, fssize, dir_inode, s->entry - 1);
+            if (entry && entry->name_len == name_len && !memcmp(entry->name, name, name_len)) return s->entry - 1;
+        }
+        return (size_t)-1;
+    }
+
+    /*Linear scan for small directories, the stored hash rejects most
+      entries without touching their names*/
+    size_t pos = 0;
+    directory_entry *entry;
+    while ((entry = next_dir_entry(fsptr, fssize, dir_inode, &pos))) {
+        if (entry->hash == hash && entry->name_len == name_len && !memcmp(entry->name, name, name_len)) return pos - entry->rec_len;
+    }
+    return (size_t)-1;
+}
+
+/**
+ * Inode offset the entry whose name is the name_len bytes at name in a
+ * directory points to, 0 if there is no such entry or the node is not a
+ * directory
+*/
+static size_t dir_entry_inode(void *fsptr, size_t fssize, fs_context *ctx, inode *dir_inode, const char *name, size_t name_len) {
+    if (!(dir_inode->mode & S_IFDIR) || name_len > MAX_FILENAME) return 0;
+
+    /*Cached lookups skip the search, missing names included*/
+    size_t dir_offset = (char*)dir_inode - (char*)fsptr;
+    uint32_t hash = name_hash(name, name_len);
+    size_t inode_offset = dcache_lookup(fsptr, fssize, ctx, dir_offset, dir_inode->generation, name, name_len, hash);
+    if (inode_offset != (size_t)-1) return inode_offset;
+
+    size_t pos = find_dir_entry(fsptr, fssize, dir_inode, name, name_len);
+    directory_entry *entry = (pos == (size_t)-1) ? NULL : get_dir_entry(fsptr, fssize, dir_inode, pos);
+    inode_offset = entry ? entry->inode_offset : 0;
+    dcache_insert(fsptr, fssize, ctx, dir_offset, dir_inode->generation, name, name_len, hash, inode_offset);
+    return inode_offset;
+}
+
+/**
+ * Find the node at the first path_len bytes of path. Each directory on the
+ * way is locked shared only while it is searched, no lock is held on return.
+ * *generation_ptr gets the generation of the node, to check it is still the
+ * same once locked.
+ */
+static inode* find_inode(void *fsptr, size_t fssize, fs_context *ctx, const char *path, size_t path_len, size_t *inode_offset_ptr, uint32_t *generation_ptr){
+    /*Get initial filesystem info*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    inode *curr_inode = (inode *)offset_to_ptr(fsptr, fssize, info_block->root_inode);
+    size_t curr_offset = info_block->root_inode;
+    /*Root is never freed, its generation stays put*/
+    uint32_t generation = curr_inode->generation;
+
+    /*No path provided*/
+    if (!path) return NULL;
+
+    /*Walk the path's components in place*/
+    const char *component;
+    size_t pos = 0, component_len;
+    while ((component_len = next_component(path, path_len, &pos, &component))) {
+        /*Look up component in directory, it has to be the one the entry
+          pointed to and still be a directory*/
+        lock_inodes(fsptr, fssize, ctx, &curr_offset, 1, 0);
+        size_t next_offset = 0;
+        if (curr_inode->generation == generation) {
+            next_offset = dir_entry_inode(fsptr, fssize, ctx, curr_inode, component, component_len);
+        }
+        inode *next_inode = next_offset ? (inode *)offset_to_ptr(fsptr, fssize, next_offset) : NULL;
+        /*The entry keeps the node alive while the directory is locked*/
+        if (next_inode) generation = next_inode->generation;
+        unlock_inodes(fsptr, fssize, ctx, &curr_offset, 1);
+
+        /*Inode not found, you must DIE*/
+        if(!next_inode) return NULL;
+
+        /*Move to next inode...*/
+        curr_inode = next_inode;
+        curr_offset = next_offset;
+    }
+
+    *inode_offset_ptr = curr_offset;
+    *generation_ptr = generation;
+    return curr_inode;
+}
+
+/**
+ * Inode number of a node, what the frontend names it by. Root is 1, other
+ * nodes carry their slot in the inode table + 2 in the low 32 bits and
+ * their generation in the high ones, so a number outliving its node is
+ * never taken for the node that reuses the slot.
+ */
+static uint64_t inode_number(void *fsptr, size_t inode_offset, uint32_t generation){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    if (inode_offset == info_block->root_inode) return ROOT_INO;
+    return ((uint64_t)generation << 32) | ((inode_offset - info_block->inode_table) / INODE_SIZE + 2);
+}
+
+/**
+ * Node named by inode number ino, with its offset and the generation the
+ * number was handed out with. NULL if ino can't name a node.
+ */
+static inode* ino_to_inode(void *fsptr, size_t fssize, uint64_t ino, size_t *inode_offset_ptr, uint32_t *generation_ptr){
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    if (ino == ROOT_INO) {
+        *inode_offset_ptr = info_block->root_inode;
+        *generation_ptr = 0;
+        return (inode*)offset_to_ptr(fsptr, fssize, info_block->root_inode);
+    }
+    size_t slot = (uint32_t)ino;
+    if (slot < 2 || slot - 2 >= info_block->max_inodes) return NULL;
+    *inode_offset_ptr = info_block->inode_table + (slot - 2) * INODE_SIZE;
+    *generation_ptr = ino >> 32;
+    return (inode*)offset_to_ptr(fsptr, fssize, *inode_offset_ptr);
+}
+
+/**
+ * Inode number of the node at the first path_len bytes of path, 0 if there
+ * is none
+ */
+static uint64_t path_to_ino(void *fsptr, size_t fssize, fs_context *ctx, const char *path, size_t path_len){
+    size_t inode_offset;
+    uint32_t generation;
+    if (!find_inode(fsptr, fssize, ctx, path, path_len, &inode_offset, &generation)) return 0;
+    return inode_number(fsptr, inode_offset, generation);
+}
+
+/**
+ * Whether name is longer than a directory entry holds. Creating and
+ * looking up names share the limit, so whatever is created can be found.
+ */
+static int name_too_long(const char *name){
+    return strnlen(name, MAX_FILENAME + 1) > MAX_FILENAME;
+}
+
+/**
+ * Why the node at the first path_len bytes of path was not found:
+ * ENAMETOOLONG if a component is longer than a name can be, else ENOENT
+ */
+static int path_error(const char *path, size_t path_len){
+    const char *component;
+    size_t pos = 0, component_len;
+    while ((component_len = next_component(path, path_len, &pos, &component))) {
+        if (component_len > MAX_FILENAME) return ENAMETOOLONG;
+    }
+    return ENOENT;
+}
+
+/**
+ * Lock the node with inode number ino, shared or exclusive. NULL if the
+ * node is gone, freed since the number was handed out.
+ */
+static inode* lock_ino(void *fsptr, size_t fssize, fs_context *ctx, uint64_t ino, int exclusive, size_t *inode_offset_ptr){
+    uint32_t generation;
+    inode *node = ino_to_inode(fsptr, fssize, ino, inode_offset_ptr, &generation);
+    if (!node) return NULL;
+    lock_inodes(fsptr, fssize, ctx, inode_offset_ptr, 1, exclusive);
+    if (node->generation == generation && node->mode) return node;
+    unlock_inodes(fsptr, fssize, ctx, inode_offset_ptr, 1);
+    return NULL;
+}
+
+/**
+ * Lock count parent directories exclusive, together with the nodes their
+ * entries called names[i] point to. locked[2 * i] gets the offset of parent
+ * i and locked[2 * i + 1] the one of its entry's node (0 if there is none).
+ * Everything is locked at once, then checked again, until no entry moved
+ * in between. Returns -1 if a parent is gone.
+ */
+static int lock_parents(void *fsptr, size_t fssize, fs_context *ctx, const uint64_t *parents, const char **names, int count, size_t *locked){
+    uint32_t generations[2];
+    if (count > 2) return -1;
+
+    for (;;) {
+        /*Peek at the parents' entries*/
+        for (int i = 0; i < count; i++) {
+            inode *parent = lock_ino(fsptr, fssize, ctx, parents[i], 0, &locked[2 * i]);
+            if (!parent) return -1;
+            generations[i] = parent->generation;
+            locked[2 * i + 1] = dir_entry_inode(fsptr, fssize, ctx, parent, names[i], strlen(names[i]));
+            unlock_inodes(fsptr, fssize, ctx, &locked[2 * i], 1);
+        }
+
+        /*Lock it all, done if parents and entries are unchanged*/
+        lock_inodes(fsptr, fssize, ctx, locked, 2 * count, 1);
+        int moved = 0;
+        for (int i = 0; i < count; i++) {
+            inode *parent = (inode*)offset_to_ptr(fsptr, fssize, locked[2 * i]);
+            if (parent->generation != generations[i] || dir_entry_inode(fsptr, fssize, ctx, parent, names[i], strlen(names[i])) != locked[2 * i + 1]) moved = 1;
+        }
+        if (!moved) return 0;
+        unlock_inodes(fsptr, fssize, ctx, locked, 2 * count);
+    }
+}
+
+/**
+ * Fill stbuf for the node with inode number ino
+ */
+static int fill_stat(inode *node, uint64_t ino, struct stat *stbuf){
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+    stbuf->st_uid = node->uid;
+    stbuf->st_gid = node->gid;
+    stbuf->st_mode = node->mode;
+    stbuf->st_size = node->size;
+    stbuf->st_atime = __atomic_load_n(&node->access_time, __ATOMIC_RELAXED);
+    stbuf->st_mtime = node->modification_time;
+    stbuf->st_ctime = node->change_time;
+
+    /*Links are kept up to date by mkdir, rmdir and rename*/
+    if(node->mode & (S_IFDIR | S_IFREG)){
+        stbuf->st_nlink = node->nlink;
+    /*Ooops, wrong type of fuiel, thoug, can we do links?*/
+    }else{
+        return -1;
+    }
+    return 0;
+}
+
+int add_dir_entry(void *fsptr, size_t fssize, fs_context *ctx, inode *dir_inode, size_t dir_inode_offset, const char *name, size_t new_inode_offset) {
+    /*Bytes the new entry needs*/
+    size_t name_len = strlen(name), need = dir_entry_len(name_len);
+    if (name_len > MAX_FILENAME) return -1;
+    size_t num_blocks = dir_inode->size / BLOCK_SIZE, pos = 0;
+    directory_entry *new_entry = NULL;
+    int err;
+
+    /*Look for room, starting at the first block that may have some*/
+    for (size_t b = dir_inode->free_hint; b < num_blocks && !new_entry; b++) {
+        char *block = (char*)get_dir_entry(fsptr, fssize, dir_inode, b * BLOCK_SIZE);
+        if (!block) return -1;
+
+        for (size_t off = 0; off < BLOCK_SIZE; off += ((directory_entry*)(block + off))->rec_len) {
+            directory_entry *entry = (directory_entry*)(block + off);
+            if (!dir_entry_ok(entry, off)) return -1;
+
+            /*Room behind the entry, or a free entry big enough*/
+            size_t used = entry->inode_offset ? dir_entry_len(entry->name_len) : 0;
+            if (entry->rec_len - used >= need) {
+                new_entry = (directory_entry*)(block + off + used);
+                if (used) {
+                    new_entry->rec_len = entry->rec_len - used;
+                    entry->rec_len = used;
+                    log_meta(fsptr, fssize, ctx, entry, sizeof(directory_entry));
+                }
+                pos = b * BLOCK_SIZE + off + used;
+                break;
+            }
+        }
+        if (!new_entry) dir_inode->free_hint = b + 1;
+    }
+
+    /*No room, chain on another block*/
+    if (!new_entry) {
+        if (grow_inode(fsptr, fssize, ctx, &err, dir_inode, num_blocks, num_blocks + 1)) return -1;
+        new_entry = get_dir_entry(fsptr, fssize, dir_inode, num_blocks * BLOCK_SIZE);
+
+        /*Bad offset*/
+        if (!new_entry) {
+            shrink_inode(fsptr, fssize, ctx, dir_inode, num_blocks + 1, num_blocks);
+            return -1;
+        }
+        new_entry->rec_len = BLOCK_SIZE;
+        pos = num_blocks * BLOCK_SIZE;
+        dir_inode->size += BLOCK_SIZE;
+        dir_inode->free_hint = num_blocks;
+    }
+
+    /*Copy name and offset into new dir entry, its block holds the entry split too*/
+    fill_dir_entry(new_entry, name, name_len, new_inode_offset);
+    log_meta(fsptr, fssize, ctx, new_entry, need);
+    dir_inode->num_entries++;
+
+    /*The name may be cached as missing*/
+    dcache_forget(fsptr, fssize, ctx, dir_inode_offset, dir_inode->generation, name);
+
+    /*Keep the index in sync, growing it past 3/4 load. Losing the index
+      only costs speed, lookups fall back to scanning.*/
+    inode *index = dir_inode->dir_index ? (inode*)offset_to_ptr(fsptr, fssize, dir_inode->dir_index) : NULL;
+    if (index && dir_inode->num_entries * 4 <= index->size / sizeof(dir_index_slot) * 3) {
+        if (index_insert(fsptr, fssize, ctx, index, new_entry->hash, pos)) drop_dir_index(fsptr, fssize, ctx, dir_inode);
+    } else if (index || dir_inode->num_entries >= DIR_INDEX_MIN_ENTRIES) {
+        build_dir_index(fsptr, fssize, ctx, dir_inode);
+    }
+    log_reindex(fsptr, fssize, ctx, dir_inode);
+
+    /*Update times*/
+    dir_inode->modification_time = dir_inode->change_time = time(NULL);
+
+    /*All good in the hood*/
+    return 0; 
+}
+
+
+/**
+ * Remove entry from dir inode
+*/
+static int remove_dir_entry(void *fsptr, size_t fssize, fs_context *ctx, inode *dir_inode, size_t dir_inode_offset, const char *name) {
+    /*Seek*/
+    size_t pos = find_dir_entry(fsptr, fssize, dir_inode, name, strlen(name));
     
-    /*Free the block*/
-    bitmap[block_num / 8] &= ~(1 << (block_num % 8)); 
+    /*Entry not found, we'll get it next time*/
+    if (pos == (size_t)-1) return -1;
+
+    /*Lookups of the name must search again*/
+    dcache_forget(fsptr, fssize, ctx, dir_inode_offset, dir_inode->generation, name);
+
+    char *block = (char*)get_dir_entry(fsptr, fssize, dir_inode, pos / BLOCK_SIZE * BLOCK_SIZE);
+    if (!block) return -1;
+    directory_entry *target = (directory_entry*)(block + pos % BLOCK_SIZE);
+
+    /*Find the entry in front of target, it swallows target's space*/
+    directory_entry *prev;
+    if (prev_dir_entry(block, pos % BLOCK_SIZE, &prev)) return -1;
+
+    /*Unhash target*/
+    inode *index = dir_inode->dir_index ? (inode*)offset_to_ptr(fsptr, fssize, dir_inode->dir_index) : NULL;
+    if (index && index_remove(fsptr, fssize, ctx, index, target->hash, pos)) drop_dir_index(fsptr, fssize, ctx, dir_inode);
+    log_reindex(fsptr, fssize, ctx, dir_inode);
+
+    /*Merge into the previous entry, a block's first entry just turns free*/
+    if (prev) prev->rec_len += target->rec_len;
+    else target->inode_offset = 0;
+    log_meta(fsptr, fssize, ctx, prev ? prev : target, sizeof(directory_entry));
+    dir_inode->num_entries--;
+    if (pos / BLOCK_SIZE < dir_inode->free_hint) dir_inode->free_hint = pos / BLOCK_SIZE;
+
+    /*Release trailing blocks once they empty*/
+    size_t num_blocks = dir_inode->size / BLOCK_SIZE, keep = num_blocks;
+    while (keep) {
+        directory_entry *first = get_dir_entry(fsptr, fssize, dir_inode, (keep - 1) * BLOCK_SIZE);
+        if (!first || first->inode_offset || first->rec_len != BLOCK_SIZE) break;
+        keep--;
+    }
+    shrink_inode(fsptr, fssize, ctx, dir_inode, num_blocks, keep);
+    dir_inode->size = keep * BLOCK_SIZE;
+    if (dir_inode->free_hint > keep) dir_inode->free_hint = keep;
+    
+    /*Update times*/
+    dir_inode->modification_time = dir_inode->change_time = time(NULL);
+    
+    /*Target obliterated*/
     return 0; 
 }
 
 /**
  * Get total blocks 
 */
-size_t calculate_total_blocks(size_t fssize) {
-    return fssize / BLOCK_SIZE;
+size_t calculate_total_blocks(void *fsptr, size_t fssize) {
+    /*Make info block*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    return info_block->max_data_blocks;
 }
 
 /**
@@ -657,19 +2705,505 @@ size_t calculate_free_blocks(void *fsptr, size_t fssize) {
     unsigned char *bitmap = get_block_bitmap(fsptr, fssize);
     if (!bitmap) return 0; 
     
-    /*Count free blocks*/
-    size_t free_blocks = 0, total_blocks = calculate_total_blocks(fssize);
-    size_t i;
+    /*Count free blocks, a popcount per word*/
+    return bitmap_count_clear((const uint64_t*)bitmap, calculate_total_blocks(fsptr, fssize));
+}
 
-    /*Itetate to blocks and check bitmap for free blocks*/
-    for (i = 0; i < total_blocks; i++) if (!(bitmap[1/8] & (1 << (i % 8)))) free_blocks++;
-    
-    /*Return number of free blocks*/
-    return free_blocks;
+/**
+ * Get number of free inodes
+*/
+size_t calculate_free_inodes(void *fsptr, size_t fssize) {
+    /*Make info block*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    /*Get the bitmap pointer*/
+    uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
+    if (!bitmap) return 0;
+
+    /*Count free inodes*/
+    return bitmap_count_clear((const uint64_t*)bitmap, info_block->max_inodes);
+}
+
+/**
+ * Sync the blocks only a node owns, its data and overflow block
+*/
+static int sync_node_blocks(void *fsptr, size_t fssize, fs_context *ctx, inode *node, sync_callback fn, void *arg) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    for (size_t i = 0; i < node->num_extents; i++) {
+        extent *ext = get_extent(fsptr, fssize, node, i);
+        if (!ext) return -1;
+        size_t first = info_block->data_blocks / BLOCK_SIZE + ext->start;
+        if (ext->count && sync_blocks(fsptr, fssize, ctx, first, first + ext->count - 1, 1, fn, arg)) return -1;
+    }
+    if (!node->extent_block) return 0;
+    return sync_blocks(fsptr, fssize, ctx, node->extent_block / BLOCK_SIZE, node->extent_block / BLOCK_SIZE, 1, fn, arg);
+}
+
+/**
+ * Sync a node locked by the caller: its blocks, those of its directory
+ * index, and the blocks holding the inodes, bitmaps and info block. Those
+ * last are shared with other nodes, so they stay dirty for a full sync.
+*/
+static int sync_node(void *fsptr, size_t fssize, fs_context *ctx, inode *node, size_t inode_offset, sync_callback fn, void *arg) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    if (sync_node_blocks(fsptr, fssize, ctx, node, fn, arg)) return -1;
+
+    inode *index = node->dir_index ? (inode*)offset_to_ptr(fsptr, fssize, node->dir_index) : NULL;
+    if (index) {
+        if (sync_node_blocks(fsptr, fssize, ctx, index, fn, arg) ||
+            sync_blocks(fsptr, fssize, ctx, node->dir_index / BLOCK_SIZE, node->dir_index / BLOCK_SIZE, 0, fn, arg)) return -1;
+    }
+
+    if (sync_blocks(fsptr, fssize, ctx, inode_offset / BLOCK_SIZE, inode_offset / BLOCK_SIZE, 0, fn, arg)) return -1;
+    return sync_blocks(fsptr, fssize, ctx, 0, (info_block->journal - 1) / BLOCK_SIZE, 0, fn, arg);
+}
+
+/**
+ * Transaction seq at pos of the log if it is there and whole, else NULL
+*/
+static journal_tx* journal_tx_at(char *log, size_t log_bytes, size_t pos, uint64_t seq) {
+    if (pos + sizeof(journal_tx) > log_bytes) return NULL;
+    journal_tx *tx = (journal_tx*)(log + pos);
+    if (tx->magic != JOURNAL_TX_MAGIC || tx->seq != seq || tx->len < sizeof(journal_tx) || tx->len % 8 || tx->len > log_bytes - pos) return NULL;
+
+    /*Checksum as it was taken, with the field 0*/
+    journal_tx head = *tx;
+    head.checksum = 0;
+    uint32_t checksum = journal_checksum(2166136261u, &head, sizeof(head));
+    checksum = journal_checksum(checksum, tx + 1, tx->len - sizeof(journal_tx));
+    return (checksum == tx->checksum) ? tx : NULL;
+}
+
+/**
+ * Transaction seq of the log, at pos or at the start of the log if it
+ * wrapped before it, else NULL. pos and used are moved past it.
+*/
+static journal_tx* journal_tx_next(char *log, size_t log_bytes, size_t *pos, size_t *used, uint64_t seq) {
+    size_t at = *pos, skip = 0;
+    journal_tx *tx = journal_tx_at(log, log_bytes, at, seq);
+    if (!tx && at) {
+        tx = journal_tx_at(log, log_bytes, 0, seq);
+        skip = log_bytes - at;
+        at = 0;
+    }
+    if (!tx || *used + skip + tx->len > log_bytes) return NULL;
+    *pos = at + tx->len;
+    *used += skip + tx->len;
+    return tx;
+}
+
+/**
+ * Bitmap or re-indexing record of the log, with the transaction it is in
+*/
+typedef struct{
+    journal_rec rec;
+    uint64_t seq;
+}journal_later;
+
+/**
+ * Order of bitmap records, re-indexing goes last
+*/
+static int journal_later_cmp(const void *a, const void *b) {
+    uint64_t x = ((const journal_later*)a)->rec.alloc_seq, y = ((const journal_later*)b)->rec.alloc_seq;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Whether the bytes at offset, logged by transaction seq, are revoked.
+ * revoke holds a value for every data block, then for every inode slot:
+ * 0 if the log doesn't allocate or free it, UINT64_MAX if the log leaves
+ * it free, else one more than the transaction that allocated it last.
+ * *end is set to where the block or slot holding offset ends.
+*/
+static int journal_revoked(fs_info_block *info_block, const uint64_t *revoke, size_t offset, uint64_t seq, size_t *end) {
+    size_t n;
+    if (offset >= info_block->data_blocks) {
+        n = (offset - info_block->data_blocks) / BLOCK_SIZE;
+        *end = info_block->data_blocks + (n + 1) * BLOCK_SIZE;
+        if (n >= info_block->max_data_blocks) return 0;
+    } else if (offset >= info_block->inode_table) {
+        n = (offset - info_block->inode_table) / INODE_SIZE;
+        *end = info_block->inode_table + (n + 1) * INODE_SIZE;
+        if (n >= info_block->max_inodes) return 0;
+        n += info_block->max_data_blocks;
+    } else {
+        *end = info_block->inode_table;
+        return 0;
+    }
+    return revoke[n] && seq + 1 < revoke[n];
+}
+
+/**
+ * Redo the transactions in the journal after a crash, in order, and note
+ * where the next one goes. Bitmap records are applied after the ranges,
+ * sorted by allocation order, since transactions may be logged in another
+ * order than their allocations were made. Indexes are built last, from
+ * the redone entries. The journal is kept until the next checkpoint,
+ * redoing it again is harmless.
+ *
+ * The bitmap records are read first, and double as revoke records: a range
+ * in a data block or inode slot that was taken again by a later
+ * transaction, or is left free, is skipped. Its bytes were written for an
+ * earlier owner, and a later one may have put file data there, which is
+ * not journaled.
+*/
+static int journal_replay(void *fsptr, size_t fssize, fs_context *ctx) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    journal_header *header = get_journal(fsptr, fssize);
+    if (!header || header->magic != JOURNAL_MAGIC) return -1;
+    size_t log_bytes = (info_block->journal_blocks - 1) * BLOCK_SIZE;
+    char *log = (char*)header + BLOCK_SIZE;
+
+    journal_later *later = NULL;
+    size_t count = 0, cap = 0, pos = header->tail, used = 0;
+    uint64_t seq = header->tail_seq;
+    journal_tx *tx;
+    for (; (tx = journal_tx_next(log, log_bytes, &pos, &used, seq)); seq++) {
+        char *rec_pos = (char*)(tx + 1), *end = (char*)tx + tx->len;
+        for (uint32_t i = 0; i < tx->count && rec_pos + sizeof(journal_rec) <= end; i++) {
+            journal_rec *rec = (journal_rec*)rec_pos;
+            rec_pos += sizeof(journal_rec);
+            if (rec->type == JOURNAL_RANGE) {
+                size_t padded = ((size_t)rec->len + 7) & ~(size_t)7;
+                if (padded > (size_t)(end - rec_pos)) break;
+                rec_pos += padded;
+                continue;
+            }
+
+            /*Bitmaps and indexes wait for the end*/
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                journal_later *grown = (journal_later*)realloc(later, cap * sizeof(journal_later));
+                if (!grown) {
+                    free(later);
+                    return -1;
+                }
+                later = grown;
+            }
+            later[count++] = (journal_later){*rec, tx->seq};
+        }
+    }
+
+    /*The last allocation or free of a block or slot tells which ranges stand*/
+    uint64_t *revoke = NULL;
+    if (count) {
+        qsort(later, count, sizeof(journal_later), journal_later_cmp);
+        revoke = (uint64_t*)calloc(info_block->max_data_blocks + info_block->max_inodes, sizeof(uint64_t));
+        if (!revoke) {
+            free(later);
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        journal_rec *rec = &later[i].rec;
+        if (rec->type != JOURNAL_BLOCK_BITS && rec->type != JOURNAL_INODE_BITS) continue;
+        size_t max = (rec->type == JOURNAL_BLOCK_BITS) ? info_block->max_data_blocks : info_block->max_inodes;
+        uint64_t *slots = (rec->type == JOURNAL_BLOCK_BITS) ? revoke : revoke + info_block->max_data_blocks;
+        for (size_t n = rec->offset; n < rec->offset + rec->len && n < max; n++) {
+            slots[n] = rec->value ? later[i].seq + 1 : UINT64_MAX;
+        }
+    }
+
+    /*Copy the ranges that stand, in order*/
+    pos = header->tail;
+    used = 0;
+    for (seq = header->tail_seq; (tx = journal_tx_next(log, log_bytes, &pos, &used, seq)); seq++) {
+        char *rec_pos = (char*)(tx + 1), *end = (char*)tx + tx->len;
+        for (uint32_t i = 0; i < tx->count && rec_pos + sizeof(journal_rec) <= end; i++) {
+            journal_rec *rec = (journal_rec*)rec_pos;
+            rec_pos += sizeof(journal_rec);
+            if (rec->type != JOURNAL_RANGE) continue;
+            size_t padded = ((size_t)rec->len + 7) & ~(size_t)7;
+            if (padded > (size_t)(end - rec_pos)) break;
+            if (rec->offset >= info_block->root_inode && rec->offset <= fssize && rec->len <= fssize - rec->offset) {
+                for (size_t at = rec->offset, stop; at < rec->offset + rec->len; at = stop) {
+                    int revoked = revoke && journal_revoked(info_block, revoke, at, seq, &stop);
+                    if (!revoke || stop > rec->offset + rec->len) stop = rec->offset + rec->len;
+                    if (!revoked) memcpy((char*)fsptr + at, rec_pos + (at - rec->offset), stop - at);
+                }
+            }
+            rec_pos += padded;
+        }
+    }
+    free(revoke);
+
+    for (size_t i = 0; i < count; i++) {
+        journal_rec *rec = &later[i].rec;
+        if (rec->type == JOURNAL_BLOCK_BITS || rec->type == JOURNAL_INODE_BITS) {
+            size_t max = (rec->type == JOURNAL_BLOCK_BITS) ? info_block->max_data_blocks : info_block->max_inodes;
+            for (size_t n = rec->offset; n < rec->offset + rec->len && n < max; n++) {
+                if (rec->type == JOURNAL_BLOCK_BITS) {
+                    if (rec->value) mark_block_used(fsptr, fssize, ctx, n);
+                    else mark_block_free(fsptr, fssize, ctx, n);
+                } else {
+                    if (rec->value) mark_inode_used(fsptr, fssize, ctx, n);
+                    else mark_inode_free(fsptr, fssize, ctx, n);
+                }
+            }
+            if (rec->alloc_seq + rec->len > ctx->alloc_seq) ctx->alloc_seq = rec->alloc_seq + rec->len;
+        } else if (rec->type == JOURNAL_REINDEX) {
+            inode *dir_inode = (rec->offset >= info_block->root_inode) ? (inode*)offset_to_ptr(fsptr, fssize, rec->offset) : NULL;
+            if (dir_inode && (dir_inode->mode & S_IFDIR) && dir_inode->dir_index) build_dir_index(fsptr, fssize, ctx, dir_inode);
+        }
+    }
+    free(later);
+
+    ctx->journal_head = pos;
+    ctx->journal_used = used;
+    ctx->journal_seq = ctx->journal_synced = seq;
+    return 0;
+}
+
+/**
+ * Slot of the inode at offset in the inode table, (size_t)-1 if offset is
+ * not one of the table's inodes
+*/
+static size_t inode_slot(fs_info_block *info_block, size_t offset) {
+    if (offset < info_block->inode_table || (offset - info_block->inode_table) % INODE_SIZE) return (size_t)-1;
+    size_t n = (offset - info_block->inode_table) / INODE_SIZE;
+    return (n < info_block->max_inodes) ? n : (size_t)-1;
+}
+
+/**
+ * Set the bits of a node's data blocks, overflow block and hash index in
+ * the bitmaps being rebuilt. Blocks past the data blocks are ignored.
+*/
+static void repair_mark_node(void *fsptr, size_t fssize, inode *node, uint8_t *inodes, uint8_t *blocks) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    size_t n;
+    if (node->extent_block >= info_block->data_blocks && (node->extent_block - info_block->data_blocks) % BLOCK_SIZE == 0) {
+        n = (node->extent_block - info_block->data_blocks) / BLOCK_SIZE;
+        if (n < info_block->max_data_blocks) blocks[n / 8] |= 1 << (n % 8);
+    }
+    for (size_t i = 0; i < node->num_extents && i < MAX_EXTENTS; i++) {
+        extent *ext = get_extent(fsptr, fssize, node, i);
+        if (!ext) break;
+        for (n = ext->start; n < (size_t)ext->start + ext->count && n < info_block->max_data_blocks; n++) blocks[n / 8] |= 1 << (n % 8);
+    }
+
+    /*The index is a hidden inode of its own*/
+    n = node->dir_index ? inode_slot(info_block, node->dir_index) : (size_t)-1;
+    if (n == (size_t)-1 || inodes[n / 8] & (1 << (n % 8))) return;
+    inodes[n / 8] |= 1 << (n % 8);
+    repair_mark_node(fsptr, fssize, (inode*)((char*)fsptr + node->dir_index), inodes, blocks);
+}
+
+/**
+ * Append value to a growing array of size_t, -1 if out of memory
+*/
+static int repair_push(size_t **values, size_t *count, size_t *cap, size_t value) {
+    if (*count == *cap) {
+        size_t *grown = (size_t*)realloc(*values, (*cap ? *cap * 2 : 64) * sizeof(size_t));
+        if (!grown) return -1;
+        *values = grown;
+        *cap = *cap ? *cap * 2 : 64;
+    }
+    (*values)[(*count)++] = value;
+    return 0;
+}
+
+/**
+ * Check the entries of a directory reached from parent_offset, after a
+ * crash. Entries naming an inode out of the table, a free slot (mode 0)
+ * or a node reached before, which can only be left by a half done call,
+ * are removed: they would name whatever takes the slot next, or be a
+ * second link no node has. . and .. are pointed back at the directory and
+ * parent_offset. The nodes named are marked in inodes, the directories
+ * among them appended to dirs as pairs of their offset and dir_offset.
+ * num_entries and nlink are counted again. Returns 1 if the hash index
+ * needs building again, -1 if out of memory.
+*/
+static int repair_dir(void *fsptr, size_t fssize, inode *dir_inode, size_t dir_offset, size_t parent_offset, uint8_t *inodes, uint8_t *blocks, size_t **dirs, size_t *count, size_t *cap) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    size_t pos = 0, entries = 0, subdirs = 0;
+    int changed = 0;
+    directory_entry *entry;
+    while ((entry = next_dir_entry(fsptr, fssize, dir_inode, &pos))) {
+        size_t at = pos - entry->rec_len;
+        int dots = (entry->name_len <= 2 && !memcmp(entry->name, "..", entry->name_len)) ? entry->name_len : 0;
+        if (dots) {
+            entry->inode_offset = (dots == 2) ? parent_offset : dir_offset;
+            entries++;
+            continue;
+        }
+
+        /*A name that stands*/
+        size_t n = inode_slot(info_block, entry->inode_offset);
+        inode *node = (n != (size_t)-1) ? (inode*)((char*)fsptr + entry->inode_offset) : NULL;
+        if (node && node->mode && !(inodes[n / 8] & (1 << (n % 8)))) {
+            inodes[n / 8] |= 1 << (n % 8);
+            entries++;
+            if (!(node->mode & S_IFDIR)) {
+                repair_mark_node(fsptr, fssize, node, inodes, blocks);
+                continue;
+            }
+            subdirs++;
+            if (repair_push(dirs, count, cap, entry->inode_offset) || repair_push(dirs, count, cap, dir_offset)) return -1;
+            continue;
+        }
+
+        /*Left by a half done call, merged away as remove_dir_entry does*/
+        directory_entry *prev;
+        char *block = (char*)get_dir_entry(fsptr, fssize, dir_inode, at / BLOCK_SIZE * BLOCK_SIZE);
+        if (!block || prev_dir_entry(block, at % BLOCK_SIZE, &prev)) continue;
+        if (prev) prev->rec_len += entry->rec_len;
+        else entry->inode_offset = 0;
+        if (at / BLOCK_SIZE < dir_inode->free_hint) dir_inode->free_hint = at / BLOCK_SIZE;
+        changed = 1;
+    }
+
+    if (dir_inode->num_entries != entries) changed = 1;
+    dir_inode->num_entries = entries;
+    dir_inode->nlink = 2 + subdirs;
+    return changed && dir_inode->dir_index;
+}
+
+/**
+ * Rebuild the inode and data block bitmaps from what the root reaches,
+ * for an image that was not unmounted clean. It is mapped shared, so the
+ * kernel may have written any page back ahead of the transaction that
+ * changed it: a bitmap after an allocation whose transaction never made
+ * it to the journal, or not after a free that did, and an entry before
+ * the inode it names. Inodes and blocks marked used that no node reaches
+ * are freed, those reached are marked used, and entries that name no
+ * node are removed (see repair_dir). The summaries, free counts and the
+ * indexes of directories that lost entries follow. Returns -1 if out of
+ * memory.
+*/
+static int repair_bitmaps(void *fsptr, size_t fssize, fs_context *ctx) {
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    uint8_t *inodes = (uint8_t*)calloc(1, bitmap_bytes(info_block->max_inodes));
+    uint8_t *blocks = (uint8_t*)calloc(1, bitmap_bytes(info_block->max_data_blocks));
+    size_t *dirs = NULL, *reindex = NULL;
+    size_t count = 0, cap = 0, reindex_count = 0, reindex_cap = 0;
+    int res = -1;
+    if (!inodes || !blocks) goto done;
+
+    /*Slot 0 stands for the root, which lives before the table and is its
+      own parent. Directories to walk go in pairs with their parent.*/
+    inodes[0] |= 1;
+    if (repair_push(&dirs, &count, &cap, info_block->root_inode) || repair_push(&dirs, &count, &cap, info_block->root_inode)) goto done;
+    while (count) {
+        size_t parent_offset = dirs[--count], dir_offset = dirs[--count];
+        inode *dir_inode = (inode*)offset_to_ptr(fsptr, fssize, dir_offset);
+        if (!dir_inode) continue;
+        repair_mark_node(fsptr, fssize, dir_inode, inodes, blocks);
+        int stale = repair_dir(fsptr, fssize, dir_inode, dir_offset, parent_offset, inodes, blocks, &dirs, &count, &cap);
+        if (stale < 0 || (stale && repair_push(&reindex, &reindex_count, &reindex_cap, dir_offset))) goto done;
+    }
+
+    /*Bring the bitmaps in line, bit by bit where they differ*/
+    uint8_t *inode_bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
+    uint8_t *block_bitmap = (uint8_t*)block_map_level(fsptr, fssize, 0);
+    if (!inode_bitmap || !block_bitmap) goto done;
+    for (size_t n = 0; n < info_block->max_inodes; n++) {
+        int used = inodes[n / 8] & (1 << (n % 8));
+        if (used == (inode_bitmap[n / 8] & (1 << (n % 8)))) continue;
+        if (used) mark_inode_used(fsptr, fssize, ctx, n);
+        else mark_inode_free(fsptr, fssize, ctx, n);
+    }
+    for (size_t n = 0; n < info_block->max_data_blocks; n++) {
+        int used = blocks[n / 8] & (1 << (n % 8));
+        if (used == (block_bitmap[n / 8] & (1 << (n % 8)))) continue;
+        if (used) mark_block_used(fsptr, fssize, ctx, n);
+        else mark_block_free(fsptr, fssize, ctx, n);
+    }
+
+    /*Indexes last, they may take or give back blocks*/
+    for (size_t i = 0; i < reindex_count; i++) build_dir_index(fsptr, fssize, ctx, (inode*)((char*)fsptr + reindex[i]));
+    res = 0;
+
+done:
+    free(inodes);
+    free(blocks);
+    free(dirs);
+    free(reindex);
+    return res;
 }
 
 /* End of helper functions */
 
+/* Same as __myfs_getattr_implem, for the node with inode number ino.
+   st_ino is set to ino.
+*/
+int __myfs_getattr_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uid_t uid, gid_t gid, uint64_t ino, struct stat *stbuf) {
+    /*Init fs*/
+    if(!init_fs(fsptr, fssize, ctx)){
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*Lock the node*/
+    size_t inode_offset;
+    inode *node = lock_ino(fsptr, fssize, ctx, ino, 0, &inode_offset);
+    if(!node){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+
+    /*Populate stbuf*/
+    if (fill_stat(node, ino, stbuf)) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    stbuf->st_atime = node_atime(fsptr, fssize, ctx, node, inode_offset);
+
+    /*Success!*/
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    return 0;
+}
+
+/* Implements the lookup of the entry called name in the directory with
+   inode number parent, filling stbuf for the node it points to like
+   __myfs_getattr_ino_implem does. Its inode number is in st_ino.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+*/
+int __myfs_lookup_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uid_t uid, gid_t gid, uint64_t parent, const char *name, struct stat *stbuf) {
+    /*Init fs*/
+    if(!init_fs(fsptr, fssize, ctx)){
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*No entry can have a longer name*/
+    if (name_too_long(name)) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    /*Lock parent*/
+    size_t parent_inode_offset;
+    inode *parent_dir = lock_ino(fsptr, fssize, ctx, parent, 0, &parent_inode_offset);
+    if (!parent_dir) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+
+    /*Verify parent is dir*/
+    if (!(parent_dir->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, &parent_inode_offset, 1);
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    /*One component, one search*/
+    size_t inode_offset = dir_entry_inode(fsptr, fssize, ctx, parent_dir, name, strlen(name));
+    inode *node = inode_offset ? (inode*)offset_to_ptr(fsptr, fssize, inode_offset) : NULL;
+    if (!node) {
+        unlock_inodes(fsptr, fssize, ctx, &parent_inode_offset, 1);
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    uint64_t ino = inode_number(fsptr, inode_offset, node->generation);
+    unlock_inodes(fsptr, fssize, ctx, &parent_inode_offset, 1);
+
+    /*Stat the node*/
+    return __myfs_getattr_ino_implem(fsptr, fssize, ctx, errnoptr, uid, gid, ino, stbuf);
+}
+
 /* Implements an emulation of the stat system call on the filesystem 
    of size fssize pointed to by fsptr. 
    
@@ -696,46 +3230,99 @@ size_t calculate_free_blocks(void *fsptr, size_t fssize) {
    st_mtim
 
 */
-int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr, uid_t uid, gid_t gid, const char *path, struct stat *stbuf) {
+int __myfs_getattr_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uid_t uid, gid_t gid, const char *path, struct stat *stbuf) {
     /*Init fs*/
-    if(!init_fs(fsptr, fssize)){
+    if(!init_fs(fsptr, fssize, ctx)){
         *errnoptr = EFAULT;
         return -1;
     }
     
     /*Find inode to path*/
+    uint64_t ino = path_to_ino(fsptr, fssize, ctx, path, strlen(path));
+    if(!ino){
+        *errnoptr = path_error(path, strlen(path));
+        return -1;
+    }
+
+    return __myfs_getattr_ino_implem(fsptr, fssize, ctx, errnoptr, uid, gid, ino, stbuf);
+}
+
+/* Same as __myfs_readdir_implem, for the node with inode number ino */
+int __myfs_readdir_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr,  uint64_t ino, char ***namesptr) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*Lock the node*/
     size_t inode_offset;
-    inode *node = find_inode(fsptr, fssize, path, &inode_offset);
-    if(!node){
+    inode *dir_inode = lock_ino(fsptr, fssize, ctx, ino, 0, &inode_offset);
+    if (!dir_inode) {
         *errnoptr = ENOENT;
         return -1;
     }
 
-    /*Populate stbuf*/
-    memset(stbuf, 0, sizeof(struct stat));
-    stbuf->st_uid = node->uid;
-    stbuf->st_gid = node->gid;
-    stbuf->st_mode = node->mode;
-    stbuf->st_size = node->size;
-    stbuf->st_atime = node->access_time;
-    stbuf->st_mtime = node->modification_time;
-    stbuf->st_ctime = node->change_time;
+    /*If INODE not dir*/
+    if (!(dir_inode->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    /*Count entries except .. .*/
+    size_t valid_entries = 0, pos = 0;
+    directory_entry *entry;
+    while ((entry = next_dir_entry(fsptr, fssize, dir_inode, &pos))) {
+        if (strcmp(entry->name, ".") && strcmp(entry->name, "..")) valid_entries++;
+    }
+
+    /*Ret 0 if no valid entries*/
+    if (!valid_entries) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        *namesptr = NULL; 
+        return 0;
+    }
+
+    /*Allocate names array*/
+    char **names_array = calloc(valid_entries, sizeof(char *));
+    if (!names_array) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    size_t current_name = 0;
 
-    /*Set num links for directories*/
-    if(node->mode & S_IFDIR){
-        size_t num_entries = node->size / sizeof(directory_entry);
-        stbuf->st_nlink = num_entries;
-    /*Set 1 link for a file*/
-    }else if(node->mode & S_IFREG){
-        stbuf->st_nlink = 1;
-    /*Ooops, wrong type of fuiel, thoug, can we do links?*/
-    }else{
-        *errnoptr = EINVAL;
-        return -1;
+    /*Copy each name*/
+    pos = 0;
+    while (current_name < valid_entries && (entry = next_dir_entry(fsptr, fssize, dir_inode, &pos))) {
+        /*Skip . and ..*/
+        if (!strcmp(entry->name, ".") || !strcmp(entry->name, "..")) continue;
+
+        /*Allocate memory for str*/
+        size_t name_len = entry->name_len;
+        names_array[current_name] = malloc(name_len + 1);
+        if (!names_array[current_name]) {
+            /*Malloc failed, clean*/
+            for (size_t j = 0; j < current_name; j++) free(names_array[j]);
+            free(names_array);
+            unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+            *errnoptr = EINVAL;
+            return -1;
+        }
+
+        /*Copy name*/
+        strcpy(names_array[current_name], entry->name);
+        current_name++;
     }
 
-    /*Success!*/
-    return 0;
+    /*Assign array to namesptr*/
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    *namesptr = names_array;
+
+    /*Return num names*/
+    return valid_entries;
 }
 
 /* Implements an emulation of the readdir system call on the filesystem 
@@ -774,1374 +3361,1918 @@ int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr, uid_t uid,
    indicated by returning -1 and setting *errnoptr to EINVAL.__myfs_readdir_implem
 
 */
-int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,  const char *path, char ***namesptr) {
-    /*Init fs*/
-    if (!init_fs(fsptr, fssize)) {
+int __myfs_readdir_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr,  const char *path, char ***namesptr) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*Find inode for path*/
+    uint64_t ino = path_to_ino(fsptr, fssize, ctx, path, strlen(path));
+    if (!ino) {
+        *errnoptr = path_error(path, strlen(path));
+        return -1;
+    }
+
+    return __myfs_readdir_ino_implem(fsptr, fssize, ctx, errnoptr, ino, namesptr);
+}
+
+/* Same as __myfs_readdir_stream_implem, for the node with inode number ino */
+int __myfs_readdir_stream_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino, off_t offset, dir_callback fn, void *arg) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*Bad offset*/
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    /*Lock the node*/
+    size_t inode_offset;
+    inode *dir_inode = lock_ino(fsptr, fssize, ctx, ino, 0, &inode_offset);
+    if (!dir_inode) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+
+    /*If INODE not dir*/
+    if (!(dir_inode->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    /*An entry's offset is its byte position + 1, the listing resumes at
+      the first entry starting at or behind offset. The block is walked
+      from its start, so an entry removed since the last call can't leave
+      the walk in the middle of another one.*/
+    size_t resume = offset, pos = resume / BLOCK_SIZE * BLOCK_SIZE;
+    directory_entry *entry;
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    while ((entry = next_dir_entry(fsptr, fssize, dir_inode, &pos))) {
+        size_t start = pos - entry->rec_len;
+        if (start < resume) continue;
+
+        /*The entry keeps its node alive while the directory is locked*/
+        inode *node = (inode*)offset_to_ptr(fsptr, fssize, entry->inode_offset);
+        if (!node) continue;
+        st.st_ino = inode_number(fsptr, entry->inode_offset, node->generation);
+        st.st_mode = node->mode & S_IFMT;
+        if (fn(arg, entry->name, &st, (off_t)start + 1)) break;
+    }
+
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    return 0;
+}
+
+/* Streams the listing of the directory at path to fn, one entry at a
+   time straight from the directory's blocks, with nothing allocated.
+   Unlike __myfs_readdir_implem, . and .. are included.
+
+   The listing starts at offset, 0 for the beginning, and goes on until
+   the directory ends or fn returns non-zero. Each entry comes with the
+   offset to resume behind it, so a huge directory can be listed over
+   many calls. Entries added or removed between calls may or may not be
+   listed, the others are listed exactly once.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 readdir.
+*/
+int __myfs_readdir_stream_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path, off_t offset, dir_callback fn, void *arg) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*Find inode for path*/
+    uint64_t ino = path_to_ino(fsptr, fssize, ctx, path, strlen(path));
+    if (!ino) {
+        *errnoptr = path_error(path, strlen(path));
+        return -1;
+    }
+
+    return __myfs_readdir_stream_ino_implem(fsptr, fssize, ctx, errnoptr, ino, offset, fn, arg);
+}
+
+/* Same as __myfs_mknod_implem, for the entry called name in the directory
+   with inode number parent. If stbuf is not NULL, it is filled for the
+   new node like __myfs_getattr_ino_implem does.
+*/
+int __myfs_mknod_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t parent, const char *name, struct stat *stbuf) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*No entry can have a longer name*/
+    if (name_too_long(name)) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    /*Find parent dir and lock it*/
+    size_t locked[2];
+    if (lock_parents(fsptr, fssize, ctx, &parent, &name, 1, locked)) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    size_t parent_inode_offset = locked[0];
+    inode *parent_dir = (inode *)offset_to_ptr(fsptr, fssize, parent_inode_offset);
+
+    /*Verify parent is dir*/
+    if (!(parent_dir->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    /*Check if file exists*/
+    if (locked[1]) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = EEXIST;
+        return -1;
+    }
+
+    /*Find free inode*/
+    size_t new_inode_offset = find_free_inode(fsptr, fssize, ctx);
+    if (new_inode_offset == (size_t)-1) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    /*Init inode*/
+    inode *new_inode = (inode *)offset_to_ptr(fsptr, fssize, new_inode_offset);
+    if (!new_inode) {
+        /*Unmark the inode in bitmap*/
+        release_inode(fsptr, fssize, ctx, new_inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = EIO;
+        return -1;
+    }
+
+    /*Set inode info for file*/
+    new_inode->mode = S_IFREG | 0644;
+    new_inode->uid = getuid();
+    new_inode->gid = getgid();
+    new_inode->size = 0;
+    new_inode->access_time = new_inode->modification_time = new_inode->change_time = time(NULL);
+    new_inode->num_extents = 0;
+    new_inode->extent_block = 0;
+    new_inode->num_entries = 0;
+    new_inode->nlink = 1;
+    new_inode->dir_index = 0;
+    new_inode->free_hint = 0;
+
+    /*Add entry to parent dir*/
+    if (add_dir_entry(fsptr, fssize, ctx, parent_dir, parent_inode_offset, name, new_inode_offset) != 0) {
+        /* Failed to add dir, unmark the inode in bitmap and reset it*/
+        release_inode(fsptr, fssize, ctx, new_inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    /*Stat the new node for the caller*/
+    if (stbuf) fill_stat(new_inode, inode_number(fsptr, new_inode_offset, new_inode->generation), stbuf);
+
+    /*Clean up*/
+    unlock_inodes(fsptr, fssize, ctx, locked, 2);
+    
+    /*Success!*/
+    return 0;
+}
+
+/* Same as __myfs_mknod_implem, also setting *inoptr (if not NULL) to the
+   inode number of the new file. The node is allocated and entered in
+   its directory under one lock of the parent, and the number can be
+   used as the handle of the open file without looking the path up. */
+int __myfs_create_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path, uint64_t *inoptr) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*Split path*/
+    size_t parent_len;
+    const char *file_name;
+    if (split_path(path, &parent_len, &file_name)) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    /*Find parent dir*/
+    uint64_t parent = path_to_ino(fsptr, fssize, ctx, path, parent_len);
+    if (!parent) {
+        *errnoptr = path_error(path, parent_len);
+        return -1;
+    }
+
+    /*Create the file, its inode number comes back in the stat*/
+    struct stat stbuf;
+    int res = __myfs_mknod_ino_implem(fsptr, fssize, ctx, errnoptr, parent, file_name, inoptr ? &stbuf : NULL);
+    if (!res && inoptr) *inoptr = stbuf.st_ino;
+    return res;
+}
+
+/* Implements an emulation of the mknod system call for regular files
+   on the filesystem of size fssize pointed to by fsptr.
+
+   This function is called only for the creation of regular files.
+
+   If a file gets created, it is of size zero and has default
+   ownership and mode bits.
+
+   The call creates the file indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 mknod.
+
+*/
+int __myfs_mknod_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path) {
+    return __myfs_create_implem(fsptr, fssize, ctx, errnoptr, path, NULL);
+}
+
+/* Same as __myfs_unlink_implem, for the entry called name in the directory
+   with inode number parent
+*/
+int __myfs_unlink_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t parent, const char *name) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*No entry can have a longer name*/
+    if (name_too_long(name)) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    /*Find parent dir, lock it and the target*/
+    size_t locked[2];
+    if (lock_parents(fsptr, fssize, ctx, &parent, &name, 1, locked)) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    size_t parent_inode_offset = locked[0];
+    inode *parent_dir = (inode *)offset_to_ptr(fsptr, fssize, parent_inode_offset);
+
+    /*Verify parent is dir*/
+    if (!(parent_dir->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    /*404, File not found*/
+    size_t target_inode_offset = locked[1];
+    inode *target_inode = target_inode_offset ? (inode *)offset_to_ptr(fsptr, fssize, target_inode_offset) : NULL;
+    if (!target_inode) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOENT;
+        return -1;
+    }
+
+    /*Verify it's a file*/
+    if (!(target_inode->mode & S_IFREG)) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = EISDIR;
+        return -1;
+    }
+
+    /*Remove directory entry*/
+    if (remove_dir_entry(fsptr, fssize, ctx, parent_dir, parent_inode_offset, name)) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = EIO;
+        return -1;
+    }
+
+    /*Free dblocks allocated and the inode, once no one has it open*/
+    unlink_inode(fsptr, fssize, ctx, target_inode_offset);
+
+    /*Cleanup and ret*/
+    unlock_inodes(fsptr, fssize, ctx, locked, 2);
+    return 0;
+}
+
+/* Implements an emulation of the unlink system call for regular files
+   on the filesystem of size fssize pointed to by fsptr.
+
+   This function is called only for the deletion of regular files.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 unlink.
+
+*/
+int __myfs_unlink_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*Split path into parent dir and file name*/
+    size_t parent_len;
+    const char *file_name;
+    if (split_path(path, &parent_len, &file_name)) {
+        *errnoptr = EINVAL; 
+        return -1;
+    }
+
+    /*Find parent dir*/
+    uint64_t parent = path_to_ino(fsptr, fssize, ctx, path, parent_len);
+    if (!parent) {
+        *errnoptr = path_error(path, parent_len);
+        return -1;
+    }
+
+    return __myfs_unlink_ino_implem(fsptr, fssize, ctx, errnoptr, parent, file_name);
+}
+
+/* Same as __myfs_rmdir_implem, for the entry called name in the directory
+   with inode number parent
+*/
+int __myfs_rmdir_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t parent, const char *name) {
+    /*FS Init*/
+    if (!init_fs(fsptr, fssize, ctx)) {
         *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Find inode for map*/
-    size_t inode_offset;
-    inode *dir_inode = find_inode(fsptr, fssize, path, &inode_offset);
-    if (!dir_inode) {
+    /*No entry can have a longer name*/
+    if (name_too_long(name)) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    /*Find parent dir, lock it and the target*/
+    size_t locked[2];
+    if (lock_parents(fsptr, fssize, ctx, &parent, &name, 1, locked)) {
         *errnoptr = ENOENT;
         return -1;
     }
+    size_t parent_inode_offset = locked[0];
+    inode *parent_dir = (inode *)offset_to_ptr(fsptr, fssize, parent_inode_offset);
 
-    /*If INODE not dir*/
-    if (!(dir_inode->mode & S_IFDIR)) {
+    /*Check parent is dir*/
+    if (!(parent_dir->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
         *errnoptr = ENOTDIR;
         return -1;
     }
 
-    /*Get dir entries*/
-    directory_entry *entries = (directory_entry *)offset_to_ptr(fsptr, fssize, dir_inode->data_block);
-    if (!entries) {
-        *errnoptr = EIO;
+    /*Get target dir*/
+    size_t target_inode_offset = locked[1];
+    inode *target_dir = target_inode_offset ? (inode *)offset_to_ptr(fsptr, fssize, target_inode_offset) : NULL;
+    if (!target_dir) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOENT;
         return -1;
     }
-    
-    /*Get number of entries*/
-    size_t num_entries = dir_inode->size / sizeof(directory_entry);
-    size_t valid_entries = 0;
-
-    /*Count entries except .. .*/
-    for (size_t i = 0; i < num_entries; i++) if (strcmp(entries[i].name, ".") && strcmp(entries[i].name, "..")) valid_entries++;
 
-    /*Ret 0 if no valid entries*/
-    if (!valid_entries) {
-        *namesptr = NULL; 
-        return 0;
+    /*Check if target dir is dir*/
+    if (!(target_dir->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOTDIR;
+        return -1;
     }
 
-    /*Allocate names array*/
-    char **names_array = calloc(valid_entries, sizeof(char *));
-    if (!names_array) {
-        *errnoptr = EINVAL;
+    /*Dir must be empty*/
+    size_t num_entries = target_dir->num_entries;
+    if (num_entries > 2) { // More than . and ..
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOTEMPTY;
         return -1;
     }
 
-    size_t current_name = 0;
-
-    /*Copy each name*/
-    for (size_t i = 0; i < num_entries; i++) {
-        /*Skip . and ..*/
-        if (!strcmp(entries[i].name, ".") || !strcmp(entries[i].name, "..")) continue;
-
-        /*Allocate memory for str*/
-        size_t name_len = strlen(entries[i].name);
-        names_array[current_name] = malloc(name_len + 1);
-        if (!names_array[current_name]) {
-            /*Malloc failed, clean*/
-            for (size_t j = 0; j < current_name; j++) free(names_array[j]);
-            free(names_array);
-            *errnoptr = EINVAL;
+    /*Check only entries are . and ..*/
+    size_t pos = 0;
+    directory_entry *entry;
+    while ((entry = next_dir_entry(fsptr, fssize, target_dir, &pos))) {
+        if (strcmp(entry->name, ".") && strcmp(entry->name, "..")) {
+            unlock_inodes(fsptr, fssize, ctx, locked, 2);
+            *errnoptr = ENOTEMPTY;
             return -1;
         }
-
-        /*Copy name*/
-        strcpy(names_array[current_name], entries[i].name);
-        current_name++;
     }
 
-    /*Assign array to namesptr*/
-    *namesptr = names_array;
+    /*We seeked, now we destroy*/
+    if (remove_dir_entry(fsptr, fssize, ctx, parent_dir, parent_inode_offset, name) != 0) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = EIO;
+        return -1;
+    }
 
-    /*Return num names*/
-    return valid_entries;
-}
+    /*Its .. no longer links to the parent*/
+    parent_dir->nlink--;
 
-/* Implements an emulation of the mknod system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
+    /*Free dir index, data blocks and inode*/
+    destroy_inode(fsptr, fssize, ctx, target_inode_offset);
 
-   This function is called only for the creation of regular files.
+    /*Cleanup and ret*/
+    unlock_inodes(fsptr, fssize, ctx, locked, 2);
+    return 0;
+}
 
-   If a file gets created, it is of size zero and has default
-   ownership and mode bits.
+/* Implements an emulation of the rmdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
 
-   The call creates the file indicated by path.
+   The call deletes the directory indicated by path.
 
    On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 mknod.
+   The function call must fail when the directory indicated by path is
+   not empty (if there are files or subdirectories other than . and ..).
+
+   The error codes are documented in man 2 rmdir.
 
 */
-int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-    /*Init fs*/
-    if (!init_fs(fsptr, fssize)) {
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr,const char *path) {
+    /*FS Init*/
+    if (!init_fs(fsptr, fssize, ctx)) {
         *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Split path*/
-    char *parent_path = NULL;
-    char *file_name = NULL;
-    if (split_path(path, &parent_path, &file_name)) {
+    /*Split path into parent dir and dir to rm*/
+    size_t parent_len;
+    const char *dir_name;
+    if (split_path(path, &parent_len, &dir_name) != 0) {
         *errnoptr = EINVAL;
         return -1;
     }
 
     /*Find parent dir*/
-    size_t parent_inode_offset;
-    inode *parent_dir = find_inode(fsptr, fssize, parent_path, &parent_inode_offset);
-    if (!parent_dir) {
-        free(parent_path);
-        free(file_name);
+    uint64_t parent = path_to_ino(fsptr, fssize, ctx, path, parent_len);
+    if (!parent) {
+        *errnoptr = path_error(path, parent_len);
+        return -1;
+    }
+
+    return __myfs_rmdir_ino_implem(fsptr, fssize, ctx, errnoptr, parent, dir_name);
+}
+
+/* Same as __myfs_mkdir_implem, for the entry called name in the directory
+   with inode number parent. If stbuf is not NULL, it is filled for the
+   new node like __myfs_getattr_ino_implem does.
+*/
+int __myfs_mkdir_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t parent, const char *name, struct stat *stbuf) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*No entry can have a longer name*/
+    if (name_too_long(name)) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    /*Find parent inode and lock it*/
+    size_t locked[2];
+    if (lock_parents(fsptr, fssize, ctx, &parent, &name, 1, locked)) {
         *errnoptr = ENOENT;
         return -1;
     }
+    size_t parent_inode_offset = locked[0];
+    inode *parent_dir = (inode *)offset_to_ptr(fsptr, fssize, parent_inode_offset);
 
-    /*Verify parent is dir*/
+    /*Check if parent is dir*/
     if (!(parent_dir->mode & S_IFDIR)) {
-        free(parent_path);
-        free(file_name);
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
         *errnoptr = ENOTDIR;
         return -1;
     }
 
-    /*Check if file exists*/
-    directory_entry *entries = (directory_entry *)offset_to_ptr(fsptr, fssize, parent_dir->data_block);
-    if (!entries) {
-        free(parent_path);
-        free(file_name);
-        *errnoptr = EIO;
+    /*Check if dir exists*/
+    if (locked[1]) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = EEXIST;
         return -1;
     }
 
-    size_t num_entries = parent_dir->size / sizeof(directory_entry);
-    for (size_t i = 0; i < num_entries; i++) {
-        if (!strcmp(entries[i].name, file_name)) {
-                free(parent_path);
-                free(file_name);
-                *errnoptr = EEXIST;
-                return -1;
-        }
-    }
-
-    /*Find free inode*/
-    size_t new_inode_offset = find_free_inode(fsptr, fssize);
+    /*Find free inode for new dir*/
+    size_t new_inode_offset = find_free_inode(fsptr, fssize, ctx);
     if (new_inode_offset == (size_t)-1) {
-        free(parent_path);
-        free(file_name);
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
         *errnoptr = ENOSPC;
         return -1;
     }
 
-    /*Init inode*/
-    inode *new_inode = (inode *)offset_to_ptr(fsptr, fssize, new_inode_offset);
-    if (!new_inode) {
-        /*Unmark the inode in bitmap*/
-        fs_info_block *info_block = (fs_info_block*)fsptr;
-        unsigned char *bitmap = (unsigned char*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-        size_t inode_num = (new_inode_offset - info_block->inode_table) / INODE_SIZE;
-        if (inode_num < MAX_INODES) bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
-        free(parent_path);
-        free(file_name);
+    /*New iNode, 'init?*/
+    inode *new_dir_inode = (inode *)offset_to_ptr(fsptr, fssize, new_inode_offset);
+    if (!new_dir_inode) {
+        /*Unmark inode in bitmap*/
+        release_inode(fsptr, fssize, ctx, new_inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
         *errnoptr = EIO;
         return -1;
     }
 
-    /*Set inode info for file*/
-    new_inode->mode = S_IFREG | 0644;
-    new_inode->uid = getuid();
-    new_inode->gid = getgid();
-    new_inode->size = 0;
-    new_inode->access_time = new_inode->modification_time = new_inode->change_time = time(NULL);
-    new_inode->data_block = 0;
+    /*Fill up new dir iNode*/
+    reset_inode(new_dir_inode);
+    new_dir_inode->mode = S_IFDIR | 0755;
+    new_dir_inode->uid = getuid();
+    new_dir_inode->gid = getgid();
+    new_dir_inode->size = 0;
+    new_dir_inode->nlink = 2;
+    new_dir_inode->access_time = new_dir_inode->modification_time = new_dir_inode->change_time = time(NULL);
 
-    /*Add entry to parent dir*/
-    if (add_dir_entry(fsptr, fssize, parent_dir, parent_inode_offset, file_name, new_inode_offset) != 0) {
-        /* Failed to add dir, unmark the inode in bitmap*/
-        fs_info_block *info_block = (fs_info_block*)fsptr;
-        uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-        size_t inode_num = (new_inode_offset - info_block->inode_table) / INODE_SIZE;
-        if (inode_num < MAX_INODES) bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
-        /*Reset inode*/
-        memset(new_inode, 0, sizeof(inode));
-        free(parent_path);
-        free(file_name);
+    /*Init new entries(add "." and ".."), this gets the first data block*/
+    if (add_dir_entry(fsptr, fssize, ctx, new_dir_inode, new_inode_offset, ".", new_inode_offset) ||
+        add_dir_entry(fsptr, fssize, ctx, new_dir_inode, new_inode_offset, "..", parent_inode_offset)) {
+        shrink_inode(fsptr, fssize, ctx, new_dir_inode, size_to_blocks(new_dir_inode->size), 0);
+        release_inode(fsptr, fssize, ctx, new_inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
         *errnoptr = ENOSPC;
         return -1;
     }
 
-    /*Clean up*/
-    free(parent_path);
-    free(file_name);
-    
-    /*Success!*/
+    /*Add new dir to parent*/
+    if (add_dir_entry(fsptr, fssize, ctx, parent_dir, parent_inode_offset, name, new_inode_offset)) {
+        shrink_inode(fsptr, fssize, ctx, new_dir_inode, size_to_blocks(new_dir_inode->size), 0);
+        release_inode(fsptr, fssize, ctx, new_inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, locked, 2);
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    /*The new dir's .. links to the parent*/
+    parent_dir->nlink++;
+
+    /*Stat the new node for the caller*/
+    if (stbuf) fill_stat(new_dir_inode, inode_number(fsptr, new_inode_offset, new_dir_inode->generation), stbuf);
+
+    /*Cleanup and return*/
+    unlock_inodes(fsptr, fssize, ctx, locked, 2);
+
     return 0;
 }
 
-/* Implements an emulation of the unlink system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
+/* Implements an emulation of the mkdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
 
-   This function is called only for the deletion of regular files.
+   The call creates the directory indicated by path.
 
    On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 unlink.
+   The error codes are documented in man 2 mkdir.
 
 */
-int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-    /*Init fs*/
-    if (!init_fs(fsptr, fssize)) {
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
         *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Split path into parent dir and file name*/
-    char *parent_path = NULL;
-    char *file_name = NULL;
-    if (split_path(path, &parent_path, &file_name)) {
-        *errnoptr = EINVAL; 
+    /*Split path into parent and child*/
+    size_t parent_len;
+    const char *dir_name;
+    if (split_path(path, &parent_len, &dir_name) != 0) {
+        *errnoptr = EINVAL;
         return -1;
     }
 
     /*Find parent dir*/
-    size_t parent_inode_offset;
-    inode *parent_dir = find_inode(fsptr, fssize, parent_path, &parent_inode_offset);
-    if (!parent_dir) {
-        free(parent_path);
-        free(file_name);
+    uint64_t parent = path_to_ino(fsptr, fssize, ctx, path, parent_len);
+    if (!parent) {
+        *errnoptr = path_error(path, parent_len);
+        return -1;
+    }
+
+    return __myfs_mkdir_ino_implem(fsptr, fssize, ctx, errnoptr, parent, dir_name, NULL);
+}
+
+/* Same as __myfs_rename_implem, for the entry called from_name in the
+   directory with inode number from_parent and the entry called to_name
+   in the one with inode number to_parent
+*/
+int __myfs_rename_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t from_parent, const char *from_name, uint64_t to_parent, const char *to_name) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*No entry can have a longer name*/
+    if (name_too_long(from_name) || name_too_long(to_name)) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    /*Lock both parents, the node to move and the one it replaces*/
+    uint64_t parents[2] = {from_parent, to_parent};
+    const char *base_names[2] = {from_name, to_name};
+    size_t locked[4];
+    if (lock_parents(fsptr, fssize, ctx, parents, base_names, 2, locked)) {
         *errnoptr = ENOENT;
         return -1;
     }
+    size_t from_parent_inode_offset = locked[0], from_inode_offset = locked[1];
+    size_t to_parent_inode_offset = locked[2], to_inode_offset = locked[3];
+    inode *from_parent_dir = (inode *)offset_to_ptr(fsptr, fssize, from_parent_inode_offset);
+    inode *to_parent_dir = (inode *)offset_to_ptr(fsptr, fssize, to_parent_inode_offset);
 
-    /*Verify parent is dir*/
-    if (!(parent_dir->mode & S_IFDIR)) {
-        free(parent_path);
-        free(file_name);
+    /*CHeck from parent is a*/
+    if (!(from_parent_dir->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 4);
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    /*Find target inode to reanme*/
+    inode *from_inode = from_inode_offset ? (inode *)offset_to_ptr(fsptr, fssize, from_inode_offset) : NULL;
+    if (!from_inode) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 4);
+        *errnoptr = ENOENT;
+        return -1;
+    }
+
+    /*Check to parent is dir*/
+    if (!(to_parent_dir->mode & S_IFDIR)) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 4);
         *errnoptr = ENOTDIR;
         return -1;
     }
 
-    /*Get entries*/
-    directory_entry *entries = (directory_entry *)offset_to_ptr(fsptr, fssize, parent_dir->data_block);
-    if (!entries) {
-        free(parent_path);
-        free(file_name);
-        *errnoptr = EIO;
+    /*Renamed onto itself, nothing to do*/
+    if (to_inode_offset == from_inode_offset) {
+        unlock_inodes(fsptr, fssize, ctx, locked, 4);
+        return 0;
+    }
+
+    /*Check to path's existance*/
+    inode *to_inode = to_inode_offset ? (inode *)offset_to_ptr(fsptr, fssize, to_inode_offset) : NULL;
+    if (to_inode) {
+        if (to_inode->mode & S_IFDIR) {
+            /*To is dir and empty, and from is dir*/
+            if (!(from_inode->mode & S_IFDIR)) {
+                unlock_inodes(fsptr, fssize, ctx, locked, 4);
+                *errnoptr = EISDIR;
+                return -1;
+            }
+
+            /*Check to is empty*/
+            size_t to_num_entries = to_inode->num_entries;
+            if (to_num_entries > 2) {
+                unlock_inodes(fsptr, fssize, ctx, locked, 4);
+                *errnoptr = ENOTEMPTY;
+                return -1;
+            }
+
+            /*Verify only entries are dot and dotdot*/
+            size_t pos = 0;
+            directory_entry *entry;
+            while ((entry = next_dir_entry(fsptr, fssize, to_inode, &pos))) {
+                if (strcmp(entry->name, ".") && strcmp(entry->name, "..")) {
+                    unlock_inodes(fsptr, fssize, ctx, locked, 4);
+                    *errnoptr = ENOTEMPTY;
+                    return -1;
+                }
+            }
+        }
+
+        /*Drop the entry of to, the node itself goes once from is in place*/
+        if (remove_dir_entry(fsptr, fssize, ctx, to_parent_dir, to_parent_inode_offset, to_name)) {
+            unlock_inodes(fsptr, fssize, ctx, locked, 4);
+            *errnoptr = EIO;
+            return -1;
+        }
+    }
+
+    /* Rm dir entry from the from parent dir*/
+    if (remove_dir_entry(fsptr, fssize, ctx, from_parent_dir, from_parent_inode_offset, from_name)) {
+        if (to_inode) add_dir_entry(fsptr, fssize, ctx, to_parent_dir, to_parent_inode_offset, to_name, to_inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, locked, 4);
+        *errnoptr = EIO;
+        return -1;
+    }
+
+    /*Add dir entry to to parent dir*/
+    if (add_dir_entry(fsptr, fssize, ctx, to_parent_dir, to_parent_inode_offset, to_name, from_inode_offset)) {
+        add_dir_entry(fsptr, fssize, ctx, from_parent_dir, from_parent_inode_offset, from_name, from_inode_offset);
+        if (to_inode) add_dir_entry(fsptr, fssize, ctx, to_parent_dir, to_parent_inode_offset, to_name, to_inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, locked, 4);
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    /*A moved dir's .. links to its new parent, a replaced one's to nothing*/
+    if (to_inode && (to_inode->mode & S_IFDIR)) to_parent_dir->nlink--;
+    if ((from_inode->mode & S_IFDIR) && from_parent_inode_offset != to_parent_inode_offset) {
+        size_t pos = find_dir_entry(fsptr, fssize, from_inode, "..", 2);
+        directory_entry *dotdot = (pos == (size_t)-1) ? NULL : get_dir_entry(fsptr, fssize, from_inode, pos);
+        if (dotdot) {
+            dcache_forget(fsptr, fssize, ctx, from_inode_offset, from_inode->generation, "..");
+            dotdot->inode_offset = to_parent_inode_offset;
+            log_meta(fsptr, fssize, ctx, dotdot, sizeof(directory_entry));
+        }
+        from_parent_dir->nlink--;
+        to_parent_dir->nlink++;
+    }
+
+    /*Replaced node is unreachable now, but may still be open*/
+    if (to_inode) unlink_inode(fsptr, fssize, ctx, to_inode_offset);
+
+    /*Cleanup and ret*/
+    unlock_inodes(fsptr, fssize, ctx, locked, 4);
+    return 0;
+}
+
+/* Implements an emulation of the rename system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call moves the file or directory indicated by from to to.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   Caution: the function does more than what is hinted to by its name.
+   In cases the from and to paths differ, the file is moved out of 
+   the from path and added to the to path.
+
+   The error codes are documented in man 2 rename.
+
+*/
+int __myfs_rename_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *from, const char *to) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*CCan't rename root*/
+    if (!strcmp(from, "/")) {
+        *errnoptr = EBUSY;
         return -1;
     }
 
-    /*Get number of entries*/
-    size_t num_entries = parent_dir->size / sizeof(directory_entry);
-    size_t target_index = num_entries;
-
-    /*Seek target*/
-    for (size_t i = 0; i < num_entries; i++) {
-        if (!strcmp(entries[i].name, file_name)) {
-                target_index = i;
-                break;
-        }
+    /*Split both names into parent and child*/
+    size_t from_parent_len, to_parent_len;
+    const char *from_base_name, *to_base_name;
+    if (split_path(from, &from_parent_len, &from_base_name) || split_path(to, &to_parent_len, &to_base_name)) {
+        *errnoptr = EINVAL;
+        return -1;
     }
 
-    /*404, File not found*/
-    if (target_index == num_entries) {
-        free(parent_path);
-        free(file_name);
-        *errnoptr = ENOENT;
+    /*Find both parents*/
+    uint64_t from_parent = path_to_ino(fsptr, fssize, ctx, from, from_parent_len);
+    uint64_t to_parent = path_to_ino(fsptr, fssize, ctx, to, to_parent_len);
+    if (!from_parent || !to_parent) {
+        *errnoptr = !from_parent ? path_error(from, from_parent_len) : path_error(to, to_parent_len);
         return -1;
     }
 
-    /*Get offset*/
-    size_t target_inode_offset = entries[target_index].inode_offset;
-    inode *target_inode = (inode *)offset_to_ptr(fsptr, fssize, target_inode_offset);
-    if (!target_inode) {
-        free(parent_path);
-        free(file_name);
-        *errnoptr = EIO;
+    return __myfs_rename_ino_implem(fsptr, fssize, ctx, errnoptr, from_parent, from_base_name, to_parent, to_base_name);
+}
+
+/* Same as __myfs_truncate_implem, for the node with inode number ino */
+int __myfs_truncate_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino, off_t offset) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Verify it's a file*/
-    if (!(target_inode->mode & S_IFREG)) {
-        free(parent_path);
-        free(file_name);
-        *errnoptr = EISDIR;
+    /*Bad offset*/
+    if (offset < 0) {
+        *errnoptr = EINVAL;
         return -1;
     }
 
-    /*Remove directory entry*/
-    if (remove_dir_entry(fsptr, fssize, parent_dir, parent_inode_offset, file_name)) {
-        free(parent_path);
-        free(file_name);
-        *errnoptr = EIO;
+    /*Lock the node*/
+    size_t inode_offset;
+    inode *file_inode = lock_ino(fsptr, fssize, ctx, ino, 1, &inode_offset);
+    if (!file_inode) {
+        *errnoptr = ENOENT;
         return -1;
     }
 
-    /*Free inode in bitmap*/
-    fs_info_block *info_block = (fs_info_block*)fsptr;
-    /*Git bitmap*/
-    uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-    if (!bitmap) {
-        *errnoptr = EIO; 
+    /*Not a file */
+    if (!(file_inode->mode & S_IFREG)) {
+        *errnoptr = EINVAL;
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
         return -1;
     }
-    /*Get inode number*/
-    size_t inode_num = (target_inode_offset - info_block->inode_table) / INODE_SIZE;
-    /*Inode don't exists*/
-    if (inode_num >= MAX_INODES) {
-        *errnoptr = EIO;
-        return -1;
+
+    /*Nothing to do, nothing to see, so everything's wrong with taking the backstreets*/
+    if ((size_t)offset == file_inode->size) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        return 0;
     }
 
-    /*Unmark inode*/
-    bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
+    /*The inode is written anyway, a held back access time goes along*/
+    flush_atime(fsptr, fssize, ctx, file_inode, inode_offset);
+    size_t have_blocks = size_to_blocks(file_inode->size), want_blocks = size_to_blocks(offset);
 
-    /*Free dblock allocated*/
-    if (target_inode->data_block) {
-        if (free_data_block(fsptr, fssize, target_inode->data_block) != 0) {
-                *errnoptr = EIO; 
-                return -1;
+    if ((size_t)offset > file_inode->size) {
+        /*Grow file, new blocks come after the last extent if possible*/
+        if (grow_inode(fsptr, fssize, ctx, errnoptr, file_inode, have_blocks, want_blocks)) {
+            unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+            return -1;
+        }
+
+        /*0 fill ext bytes*/
+        if (inode_rw(fsptr, fssize, ctx, file_inode, file_inode->size, offset - file_inode->size, NULL, NULL)) {
+            *errnoptr = EIO;
+            unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+            return -1;
         }
-    } 
+    } else {
+        /*Release blocks past the new end*/
+        shrink_inode(fsptr, fssize, ctx, file_inode, have_blocks, want_blocks);
+    }
 
-    /*Set INODE to 0*/
-    memset(target_inode, 0, sizeof(inode));
+    /*Update inode size*/
+    file_inode->size = offset;
+    /*Time to update the time*/
+    file_inode->modification_time = file_inode->change_time = time(NULL);
 
-    /*Cleanup and ret*/
-    free(parent_path);
-    free(file_name);
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
     return 0;
 }
 
-/* Implements an emulation of the rmdir system call on the filesystem 
+/* Implements an emulation of the truncate system call on the filesystem 
    of size fssize pointed to by fsptr. 
 
-   The call deletes the directory indicated by path.
+   The call changes the size of the file indicated by path to offset
+   bytes.
+
+   When the file becomes smaller due to the call, the extending bytes are
+   removed. When it becomes larger, zeros are appended.
 
    On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The function call must fail when the directory indicated by path is
-   not empty (if there are files or subdirectories other than . and ..).
-
-   The error codes are documented in man 2 rmdir.
+   The error codes are documented in man 2 truncate.
 
 */
-int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,const char *path) {
-    /*FS Init*/
-    if (!init_fs(fsptr, fssize)) {
+int __myfs_truncate_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path, off_t offset) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
         *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Split path into parent dir and dir to rm*/
-    char *parent_path = NULL;
-    char *dir_name = NULL;
-    if (split_path(path, &parent_path, &dir_name) != 0) {
-        *errnoptr = EINVAL;
-        return -1;
-    }
-
-    /*Find parent dir*/
-    size_t parent_inode_offset;
-    inode *parent_dir = find_inode(fsptr, fssize, parent_path, &parent_inode_offset);
-    if (!parent_dir) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOENT;
-        return -1;
-    }
-
-    /*Check parent is dir*/
-    if (!(parent_dir->mode & S_IFDIR)) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOTDIR;
+    /*Find inode for path*/
+    uint64_t ino = path_to_ino(fsptr, fssize, ctx, path, strlen(path));
+    if (!ino) {
+        *errnoptr = path_error(path, strlen(path));
         return -1;
     }
 
-    /*Get target dir*/
-    size_t target_inode_offset;
-    inode *target_dir = find_inode(fsptr, fssize, path, &target_inode_offset);
-    if (!target_dir) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOENT;
-        return -1;
-    }
+    return __myfs_truncate_ino_implem(fsptr, fssize, ctx, errnoptr, ino, offset);
+}
 
-    /*Check if target dir is dir*/
-    if (!(target_dir->mode & S_IFDIR)) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOTDIR;
-        return -1;
-    }
 
-    /*Dir must be empty*/
-    size_t num_entries = target_dir->size / sizeof(directory_entry);
-    if (num_entries > 2) { // More than . and ..
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOTEMPTY;
+/* Same as __myfs_open_implem, for the node with inode number ino */
+int __myfs_open_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Check only entries are . and ..*/
-    directory_entry *entries = (directory_entry *)offset_to_ptr(fsptr, fssize, target_dir->data_block);
-    if (!entries) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = EIO;
+    /*Lock the node*/
+    size_t inode_offset;
+    inode *file_inode = lock_ino(fsptr, fssize, ctx, ino, 0, &inode_offset);
+    if (!file_inode) {
+        *errnoptr = ENOENT;
         return -1;
     }
 
-    if (num_entries == 1) {
-        /*First entry must be .*/
-        if (strcmp(entries[0].name, ".")) {
-            free(parent_path);
-            free(dir_name);
-            *errnoptr = ENOTEMPTY;
+    /*Check dir integrity*/
+    if (file_inode->mode & S_IFDIR) {
+        directory_entry *entries = get_dir_entry(fsptr, fssize, file_inode, 0);
+        if (!entries) {
+            *errnoptr = EIO; 
+            unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
             return -1;
         }
-    } else if (num_entries == 2) {
-        /*Check if contains . ..*/
-        int has_dot = 0, has_dotdot = 0;
-        for (size_t i = 0; i < num_entries; i++) {
-            if (strcmp(entries[i].name, ".") == 0) has_dot = 1;
-            if (strcmp(entries[i].name, "..") == 0) has_dotdot = 1;
-        }
-        if (!has_dot || !has_dotdot) {
-            free(parent_path);
-            free(dir_name);
-            *errnoptr = ENOTEMPTY;
+
+        if (file_inode->num_entries < 2) {
+            *errnoptr = EIO; 
+            unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
             return -1;
         }
     }
 
-    /*We seeked, now we destroy*/
-    if (remove_dir_entry(fsptr, fssize, parent_dir, parent_inode_offset, dir_name) != 0) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = EIO;
-        return -1;
-    }
+    /*All good*/
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    return 0;
+}
 
-    /*Free dir data blcok*/
-    if (target_dir->data_block) {
-        if (free_data_block(fsptr, fssize, target_dir->data_block)) {
-            add_dir_entry(fsptr, fssize, parent_dir, parent_inode_offset, dir_name, target_inode_offset);
-            free(parent_path);
-            free(dir_name);
-            *errnoptr = EIO;
-            return -1;
-        }
-    }
+/* Same as __myfs_open_ino_implem for a regular file, also keeping the
+   node for the descriptor opened on it, until __myfs_release_ino_implem
+   is called for it. A file unlinked or renamed over while kept loses its
+   name at once but lives on with nlink 0, so the descriptor can still
+   read, write and sync it, like on Linux. Every successful call is to be
+   paired with a release.
 
-    /*Free the target directory's inode in the inode bitmap*/
-    fs_info_block *info_block = (fs_info_block*)fsptr;
-    unsigned char *inode_bitmap = (unsigned char*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-    if (!inode_bitmap) {
-        add_dir_entry(fsptr, fssize, parent_dir, parent_inode_offset, dir_name, target_inode_offset);
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = EIO;
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately:
+   ENOENT if there is no such node, EISDIR if it's not a regular file.
+*/
+int __myfs_open_keep_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Get numbet of inode*/
-    size_t inode_num = (target_inode_offset - info_block->inode_table) / INODE_SIZE;
-    if (inode_num >= MAX_INODES) {
-        add_dir_entry(fsptr, fssize, parent_dir, parent_inode_offset, dir_name, target_inode_offset);
-        if (target_dir->data_block) free_data_block(fsptr, fssize, target_dir->data_block);
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = EIO;
+    /*Lock the node, unlinking it takes it exclusive*/
+    size_t inode_offset;
+    inode *file_inode = lock_ino(fsptr, fssize, ctx, ino, 0, &inode_offset);
+    if (!file_inode) {
+        *errnoptr = ENOENT;
         return -1;
     }
 
-    /*Mark inode as free*/
-    inode_bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
-
-    /*Set inode to 0*/
-    memset(target_dir, 0, sizeof(inode));
+    /*Only files are opened, directories go through opendir*/
+    uint32_t *count = open_count(fsptr, fssize, ctx, inode_offset);
+    if (!(file_inode->mode & S_IFREG) || !count) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
 
-    /*Cleanup and ret*/
-    free(parent_path);
-    free(dir_name);
+    /*All good*/
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
     return 0;
 }
 
-/* Implements an emulation of the mkdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-
-   The call creates the directory indicated by path.
+/* Releases a node kept by __myfs_open_keep_ino_implem, once its
+   descriptor is closed. A node that lost its last name meanwhile is freed
+   with its last release.
 
    On success, 0 is returned.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 mkdir.
-
+   On failure, -1 is returned and *errnoptr is set appropriately: ENOENT
+   if there is no such node, EINVAL if it isn't kept.
 */
-int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+int __myfs_release_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino) {
     /*Init FS*/
-    if (!init_fs(fsptr, fssize)) {
+    if (!init_fs(fsptr, fssize, ctx)) {
         *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Split path into parent and child*/
-    char *parent_path = NULL;
-    char *dir_name = NULL;
-    if (split_path(path, &parent_path, &dir_name) != 0) {
-        *errnoptr = EINVAL;
+    /*Lock the node exclusive, it may be freed*/
+    size_t inode_offset;
+    inode *file_inode = lock_ino(fsptr, fssize, ctx, ino, 1, &inode_offset);
+    if (!file_inode) {
+        *errnoptr = ENOENT;
         return -1;
     }
 
-    /*Find parent inode*/
-    size_t parent_inode_offset;
-    inode *parent_dir = find_inode(fsptr, fssize, parent_path, &parent_inode_offset);
-    if (!parent_dir) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOENT;
+    uint32_t *count = open_count(fsptr, fssize, ctx, inode_offset);
+    if (!count || !__atomic_load_n(count, __ATOMIC_RELAXED)) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        *errnoptr = EINVAL;
         return -1;
     }
 
-    /*Check if parent is dir*/
-    if (!(parent_dir->mode & S_IFDIR)) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOTDIR;
+    /*Last descriptor of an unlinked file*/
+    if (!__atomic_sub_fetch(count, 1, __ATOMIC_RELAXED) && !file_inode->nlink) destroy_inode(fsptr, fssize, ctx, inode_offset);
+
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    return 0;
+}
+
+/* Same as __myfs_open_implem, also setting *inoptr (if not NULL) to the
+   inode number of the opened node, so later calls on the open file can
+   use the _ino_implem variants instead of resolving the path again */
+int __myfs_open_fh_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path, uint64_t *inoptr) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Get entries*/
-    directory_entry *entries = (directory_entry *)offset_to_ptr(fsptr, fssize, parent_dir->data_block);
-    if (!entries) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = EIO;
+    /*Check path input */
+    if (!path ||!strlen(path)) {
+        *errnoptr = EINVAL;
         return -1;
     }
 
-    /*Check if dir exists*/
-    size_t num_entries = parent_dir->size / sizeof(directory_entry);
-    for (size_t i = 0; i < num_entries; i++) {
-        if (!strcmp(entries[i].name, dir_name)) {
-            free(parent_path);
-            free(dir_name);
-            *errnoptr = EEXIST;
-            return -1;
-        }
+    /*Find inode for path*/
+    uint64_t ino = path_to_ino(fsptr, fssize, ctx, path, strlen(path));
+    if (!ino) {
+        *errnoptr = path_error(path, strlen(path));
+        return -1;
     }
 
-    /*Find free inode for new dir*/
-    size_t new_inode_offset = find_free_inode(fsptr, fssize);
-    if (new_inode_offset == (size_t)-1) {
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOSPC;
+    if (__myfs_open_ino_implem(fsptr, fssize, ctx, errnoptr, ino) < 0) return -1;
+    if (inoptr) *inoptr = ino;
+    return 0;
+}
+
+/* Implements an emulation of the open system call on the filesystem 
+   of size fssize pointed to by fsptr, without actually performing the opening
+   of the file (no file descriptor is returned).
+
+   The call just checks if the file (or directory) indicated by path
+   can be accessed, i.e. if the path can be followed to an existing
+   object for which the access rights are granted.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The two only interesting error codes are 
+
+   * EFAULT: the filesystem is in a bad state, we can't do anything
+
+   * ENOENT: the file that we are supposed to open doesn't exist (or a
+             subpath).
+
+   It is possible to restrict ourselves to only these two error
+   conditions. It is also possible to implement more detailed error
+   condition answers.
+
+   The error codes are documented in man 2 open.
+
+*/
+int __myfs_open_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path) {
+    return __myfs_open_fh_implem(fsptr, fssize, ctx, errnoptr, path, NULL);
+}
+
+/* Same as __myfs_read_ino_implem, but instead of copying the bytes out
+   it hands fn the runs of the image holding them, while the node is
+   still locked. fn is called once if the read gets that far, with no
+   runs at the end of the file. What it returns is returned, a negative
+   errno value as -1 with *errnoptr set. */
+int __myfs_read_runs_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino, size_t size, off_t offset, run_callback fn, void *arg) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT; 
         return -1;
     }
 
-    /*New iNode, 'init?*/
-    inode *new_dir_inode = (inode *)offset_to_ptr(fsptr, fssize, new_inode_offset);
-    if (!new_dir_inode) {
-        /*Unmark inode in bitmap*/
-        fs_info_block *info_block = (fs_info_block*)fsptr;
-        uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-        size_t inode_num = (new_inode_offset - info_block->inode_table) / INODE_SIZE;
-        if (inode_num < MAX_INODES) bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = EIO;
+    /*Bad offset*/
+    if (offset < 0) {
+        *errnoptr = EINVAL;
         return -1;
     }
 
-    /*Get data block for new dir*/
-    size_t data_block_offset = find_free_data_block(fsptr, fssize);
-    if (data_block_offset == (size_t)-1) {
-        /*Unmark inode in bitmap*/
-        fs_info_block *info_block = (fs_info_block*)fsptr;
-        unsigned char *bitmap = (unsigned char*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-        size_t inode_num = (new_inode_offset - info_block->inode_table) / INODE_SIZE;
-        if (inode_num < MAX_INODES) bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
-        /*Reset inode*/
-        memset(new_dir_inode, 0, sizeof(inode));
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOSPC;
+    /*Lock the node*/
+    size_t inode_offset;
+    inode *file_inode = lock_ino(fsptr, fssize, ctx, ino, 0, &inode_offset);
+    if (!file_inode) {
+        *errnoptr = ENOENT;
         return -1;
     }
 
-    /*Fill up new dir iNode*/
-    new_dir_inode->mode = S_IFDIR | 0755;
-    new_dir_inode->uid = getuid();
-    new_dir_inode->gid = getgid();
-    new_dir_inode->size = 0;
-    new_dir_inode->access_time = new_dir_inode->modification_time = new_dir_inode->change_time = time(NULL);
-    new_dir_inode->data_block = data_block_offset;
-
-    /*Init new entries(add "." and "..")*/
-    directory_entry *new_dir_entries = (directory_entry *)offset_to_ptr(fsptr, fssize, data_block_offset);
-    if (!new_dir_entries) {
-        /*Free data block*/
-        free_data_block(fsptr, fssize, data_block_offset);
-        /*Unmark inode in bitmap*/
-        fs_info_block *info_block = (fs_info_block*)fsptr;
-        uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-        size_t inode_num = (new_inode_offset - info_block->inode_table) / INODE_SIZE;
-        if (inode_num < MAX_INODES) bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
-        /* Reset the inode */
-        memset(new_dir_inode, 0, sizeof(inode));
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = EIO;
+    /*Check inode is file*/
+    if (!(file_inode->mode & S_IFREG)) {
+        *errnoptr = EINVAL;
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
         return -1;
     }
 
-    /*Add .*/
-    strcpy(new_dir_entries[0].name, ".");
-    new_dir_entries[0].inode_offset = new_inode_offset;
-    /*Add ..*/
-    strcpy(new_dir_entries[1].name, "..");
-    new_dir_entries[1].inode_offset = parent_inode_offset;
-    new_dir_inode->size += 2 * sizeof(directory_entry);
+    /*Check bytes to read, none beyond EOF*/
+    size_t bytes_available = ((size_t)offset < file_inode->size) ? file_inode->size - offset : 0;
+    size_t bytes_to_read = (size < bytes_available) ? size : bytes_available;
 
-    /*Add new dir to parent*/
-    if (add_dir_entry(fsptr, fssize, parent_dir, parent_inode_offset, dir_name, new_inode_offset)) {
-        /*Free data block*/
-        free_data_block(fsptr, fssize, data_block_offset);
-        /*Unmark inode in bitmap*/
-        fs_info_block *info_block = (fs_info_block*)fsptr;
-        uint8_t *bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_inode_bitmap);
-        size_t inode_num = (new_inode_offset - info_block->inode_table) / INODE_SIZE;
-        if (inode_num < MAX_INODES) bitmap[inode_num / 8] &= ~(1 << (inode_num % 8));
-        /*Reset inode*/
-        memset(new_dir_inode, 0, sizeof(inode));
-        free(parent_path);
-        free(dir_name);
-        *errnoptr = ENOSPC;
+    /*Hand the runs over*/
+    ssize_t res = inode_map_call(fsptr, fssize, file_inode, offset, bytes_to_read, fn, arg);
+    if (res < 0) {
+        *errnoptr = -res;
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
         return -1;
     }
 
-    /*Cleanup and return*/
-    free(parent_path);
-    free(dir_name);
+    /*Update inode's access time, as the mount's atime mode says*/
+    if (bytes_to_read) touch_atime(fsptr, fssize, ctx, file_inode, inode_offset);
 
-    return 0;
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    return (int)res;
 }
 
-/* Implements an emulation of the rename system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+/* Same as __myfs_read_implem, for the node with inode number ino */
+int __myfs_read_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino, char *buf, size_t size, off_t offset) {
+    /*Check buff*/
+    if (!buf) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    /*Copy data into user-provided buffer, one memcpy per run*/
+    return __myfs_read_runs_ino_implem(fsptr, fssize, ctx, errnoptr, ino, size, offset, copy_from_runs, buf);
+}
 
-   The call moves the file or directory indicated by from to to.
+/* Implements an emulation of the read system call on the filesystem 
+   of size fssize pointed to by fsptr.
 
-   On success, 0 is returned.
+   The call copies up to size bytes from the file indicated by 
+   path into the buffer, starting to read at offset. See the man page
+   for read for the details when offset is beyond the end of the file etc.
+   
+   On success, the appropriate number of bytes read into the buffer is
+   returned. The value zero is returned on an end-of-file condition.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   Caution: the function does more than what is hinted to by its name.
-   In cases the from and to paths differ, the file is moved out of 
-   the from path and added to the to path.
-
-   The error codes are documented in man 2 rename.
+   The error codes are documented in man 2 read.
 
 */
-int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr, const char *from, const char *to) {
-    /*Init FS*/
-    if (!init_fs(fsptr, fssize)) {
-        *errnoptr = EFAULT;
-        return -1;
-    }
-
-    /*CCan't rename root*/
-    if (!strcmp(from, "/")) {
-        *errnoptr = EBUSY;
+int __myfs_read_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path, char *buf, size_t size, off_t offset) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT; 
         return -1;
     }
 
-    /*Split from name into parent and child*/
-    char *from_parent_path = NULL;
-    char *from_base_name = NULL;
-    if (split_path(from, &from_parent_path, &from_base_name)) {
+    /*Check path and buff*/
+    if (!path || !buf) {
         *errnoptr = EINVAL;
         return -1;
     }
 
-    /*Split to name into parent and child*/
-    char *to_parent_path = NULL;
-    char *to_base_name = NULL;
-    if (split_path(to, &to_parent_path, &to_base_name)) {
-        free(from_parent_path);
-        free(from_base_name);
-        *errnoptr = EINVAL;
+    /*Find inode for path*/
+    uint64_t ino = path_to_ino(fsptr, fssize, ctx, path, strlen(path));
+    if (!ino) {
+        *errnoptr = path_error(path, strlen(path));
         return -1;
     }
 
-    /*Find from parent inode*/
-    size_t from_parent_inode_offset;
-    inode *from_parent_dir = find_inode(fsptr, fssize, from_parent_path, &from_parent_inode_offset);
-    if (!from_parent_dir) {
-        free(from_parent_path);
-        free(from_base_name);
-        free(to_parent_path);
-        free(to_base_name);
-        *errnoptr = ENOENT;
-        return -1;
-    }
+    return __myfs_read_ino_implem(fsptr, fssize, ctx, errnoptr, ino, buf, size, offset);
+}
 
-    /*CHeck from parent is a*/
-    if (!(from_parent_dir->mode & S_IFDIR)) {
-        free(from_parent_path);
-        free(from_base_name);
-        free(to_parent_path);
-        free(to_base_name);
-        *errnoptr = ENOTDIR;
+/* Same as __myfs_write_ino_implem, but instead of copying the bytes in
+   it hands fn the runs of the image to fill, allocated and with the
+   node still locked. fn returns how many bytes it filled, the file
+   grows by only that much. */
+int __myfs_write_runs_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino, size_t size, off_t offset, run_callback fn, void *arg) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT; 
         return -1;
     }
 
-    /*Find target inode to reanme*/
-    size_t from_inode_offset;
-    inode *from_inode = find_inode(fsptr, fssize, from, &from_inode_offset);
-    if (!from_inode) {
-        free(from_parent_path);
-        free(from_base_name);
-        free(to_parent_path);
-        free(to_base_name);
+    /*Lock the node*/
+    size_t inode_offset;
+    inode *file_inode = lock_ino(fsptr, fssize, ctx, ino, 1, &inode_offset);
+    if (!file_inode) {
         *errnoptr = ENOENT;
         return -1;
     }
 
-    /*Find to parent dir inode*/
-    size_t to_parent_inode_offset;
-    inode *to_parent_dir = find_inode(fsptr, fssize, to_parent_path, &to_parent_inode_offset);
-    if (!to_parent_dir) {
-        free(from_parent_path);
-        free(from_base_name);
-        free(to_parent_path);
-        free(to_base_name);
-        *errnoptr = ENOENT;
+    /*Check if file*/
+    if (!(file_inode->mode & S_IFREG)) {
+        *errnoptr = EINVAL; 
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
         return -1;
     }
 
-    /*Check to parent is dir*/
-    if (!(to_parent_dir->mode & S_IFDIR)) {
-        free(from_parent_path);
-        free(from_base_name);
-        free(to_parent_path);
-        free(to_base_name);
-        *errnoptr = ENOTDIR;
+    /*Bad offset*/
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
         return -1;
     }
 
-    /*Check to path's existance*/
-    size_t to_inode_offset;
-    inode *to_inode = find_inode(fsptr, fssize, to, &to_inode_offset);
-    if (to_inode) {
-        if (to_inode->mode & S_IFDIR) {
-            /*To is dir and empty, and from is dir*/
-            if (!(from_inode->mode & S_IFDIR)) {
-                free(from_parent_path);
-                free(from_base_name);
-                free(to_parent_path);
-                free(to_base_name);
-                *errnoptr = EISDIR;
-                return -1;
-            }
+    /*Nothing to write*/
+    if (!size) {
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        return 0;
+    }
 
-            /*Check to is empty*/
-            size_t to_num_entries = to_inode->size / sizeof(directory_entry);
-            if (to_num_entries > 2) {
-                free(from_parent_path);
-                free(from_base_name);
-                free(to_parent_path);
-                free(to_base_name);
-                *errnoptr = ENOTEMPTY;
-                return -1;
-            }
+    /*The inode is written anyway, a held back access time goes along*/
+    flush_atime(fsptr, fssize, ctx, file_inode, inode_offset);
 
-            /*Verify only entries are dot and dotdot*/
-            directory_entry *to_entries = (directory_entry *)offset_to_ptr(fsptr, fssize, to_inode->data_block);
-            if (!to_entries) {
-                free(from_parent_path);
-                free(from_base_name);
-                free(to_parent_path);
-                free(to_base_name);
-                *errnoptr = EIO;
-                return -1;
-            }
+    /*Check end of write doesn't wrap*/
+    size_t end = (size_t)offset + size;
+    if (end < size) {
+        *errnoptr = EFBIG;
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+        return -1;
+    }
 
-            /*At least contains .*/
-            if (to_num_entries == 1) {
-                if (strcmp(to_entries[0].name, ".") != 0) {
-                    free(from_parent_path);
-                    free(from_base_name);
-                    free(to_parent_path);
-                    free(to_base_name);
-                    *errnoptr = ENOTEMPTY;
-                    return -1;
-                }
-            /*At least . and ..*/
-            } else if (to_num_entries == 2) {
-                int has_dot = 0, has_dotdot = 0;
-                for (size_t i = 0; i < to_num_entries; i++) {
-                    if (strcmp(to_entries[i].name, ".") == 0) has_dot = 1;
-                    if (strcmp(to_entries[i].name, "..") == 0) has_dotdot = 1;
-                }
-                if (!has_dot || !has_dotdot) {
-                    free(from_parent_path);
-                    free(from_base_name);
-                    free(to_parent_path);
-                    free(to_base_name);
-                    *errnoptr = ENOTEMPTY;
-                    return -1;
-                }
-            }
+    /*Extend file*/
+    size_t have = size_to_blocks(file_inode->size);
+    if (end > file_inode->size) {
+        if (grow_inode(fsptr, fssize, ctx, errnoptr, file_inode, have, size_to_blocks(end))) {
+            unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+            return -1;
+        }
 
-            /*Remove to dir*/
-            if (__myfs_rmdir_implem(fsptr, fssize, errnoptr, to)) {
-                free(from_parent_path);
-                free(from_base_name);
-                free(to_parent_path);
-                free(to_base_name);
-                return -1;
-            }
-        } else {
-            /*to is file. Unlink*/
-            /*Can't unlink*/
-            if (__myfs_unlink_implem(fsptr, fssize, errnoptr, to)) {
-                free(from_parent_path);
-                free(from_base_name);
-                free(to_parent_path);
-                free(to_base_name);
-                return -1;
-            }
+        /*Hole between old end and offset reads as zeros*/
+        if ((size_t)offset > file_inode->size &&
+            inode_rw(fsptr, fssize, ctx, file_inode, file_inode->size, offset - file_inode->size, NULL, NULL)) {
+            shrink_inode(fsptr, fssize, ctx, file_inode, size_to_blocks(end), have);
+            *errnoptr = EIO;
+            unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+            return -1;
         }
     }
 
-    /* Rm dir entry from the from parent dir*/
-    if (remove_dir_entry(fsptr, fssize, from_parent_dir, from_parent_inode_offset, from_base_name)) {
-        free(from_parent_path);
-        free(from_base_name);
-        free(to_parent_path);
-        free(to_base_name);
-        *errnoptr = EIO;
+    /*Have the blocks filled*/
+    ssize_t res = inode_map_call(fsptr, fssize, file_inode, offset, size, fn, arg);
+    if (res > 0) mark_file_dirty(fsptr, fssize, ctx, file_inode, offset, res);
+
+    /*Give back blocks past what was written*/
+    size_t new_size = file_inode->size;
+    if (res > 0 && (size_t)offset + res > new_size) new_size = (size_t)offset + res;
+    if (size_to_blocks(end) > size_to_blocks(new_size))
+        shrink_inode(fsptr, fssize, ctx, file_inode, size_to_blocks(end), size_to_blocks(new_size));
+    if (res < 0) {
+        *errnoptr = -res;
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
         return -1;
     }
 
-    /*Add dir entry to to parent dir*/
-    if (add_dir_entry(fsptr, fssize, to_parent_dir, to_parent_inode_offset, to_base_name, from_inode_offset)) {
-        add_dir_entry(fsptr, fssize, from_parent_dir, from_parent_inode_offset, from_base_name, from_inode_offset);
-        free(from_parent_path);
-        free(from_base_name);
-        free(to_parent_path);
-        free(to_base_name);
-        *errnoptr = ENOSPC;
-        return -1;
-    }
+    /*Update metadata*/
+    file_inode->size = new_size;
+    file_inode->modification_time = file_inode->change_time = time(NULL);
 
-    /*Cleanup and ret*/
-    free(from_parent_path);
-    free(from_base_name);
-    free(to_parent_path);
-    free(to_base_name);
-    return 0;
+    /*Return bytes written*/
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    return (int)res;
 }
 
-/* Implements an emulation of the truncate system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+/* Same as __myfs_write_implem, for the node with inode number ino */
+int __myfs_write_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino, const char *buf, size_t size, off_t offset) {
+    /*Check buff*/
+    if (!buf) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
 
-   The call changes the size of the file indicated by path to offset
-   bytes.
+    /*Write to blocks, one memcpy per run*/
+    return __myfs_write_runs_ino_implem(fsptr, fssize, ctx, errnoptr, ino, size, offset, copy_to_runs, (void*)buf);
+}
 
-   When the file becomes smaller due to the call, the extending bytes are
-   removed. When it becomes larger, zeros are appended.
+/* Implements an emulation of the write system call on the filesystem 
+   of size fssize pointed to by fsptr.
 
-   On success, 0 is returned.
+   The call copies up to size bytes to the file indicated by 
+   path into the buffer, starting to write at offset. See the man page
+   for write for the details when offset is beyond the end of the file etc.
+   
+   On success, the appropriate number of bytes written into the file is
+   returned. The value zero is returned on an end-of-file condition.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 truncate.
+   The error codes are documented in man 2 write.
 
 */
-int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, off_t offset) {
-    /*Init FS*/
-    if (!init_fs(fsptr, fssize)) {
-        *errnoptr = EFAULT;
+int __myfs_write_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path, const char *buf, size_t size, off_t offset) {
+    /*Init fs*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT; 
         return -1;
     }
 
-    /*Bad offset*/
-    if (offset < 0) {
-        *errnoptr = EINVAL;
+    /*Find inode for path*/
+    uint64_t ino = path_to_ino(fsptr, fssize, ctx, path, strlen(path));
+    if (!ino) {
+        *errnoptr = path_error(path, strlen(path));
         return -1;
     }
 
-    /*Find inode for path*/
+    return __myfs_write_ino_implem(fsptr, fssize, ctx, errnoptr, ino, buf, size, offset);
+}
+
+
+/* Same as __myfs_utimens_implem, for the node with inode number ino */
+int __myfs_utimens_ino_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino, const struct timespec ts[2]) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+
+    /*Lock the node*/
     size_t inode_offset;
-    inode *file_inode = find_inode(fsptr, fssize, path, &inode_offset);
+    inode *file_inode = lock_ino(fsptr, fssize, ctx, ino, 1, &inode_offset);
     if (!file_inode) {
         *errnoptr = ENOENT;
         return -1;
     }
 
-    /*Not a file */
-    if (!(file_inode->mode & S_IFREG)) {
-        *errnoptr = EINVAL;
-        return -1;
+    /*update acces and mod times*/
+    time_t new_access_time;
+    time_t new_modification_time;
+
+    /*Ts is null, assign curr time*/
+    if (!ts) {
+        new_access_time = new_modification_time = time(NULL);
+    } else {
+        /*Set times vased on array*/
+        new_access_time = ts[0].tv_sec;
+        new_modification_time = ts[1].tv_sec;
+
+        /*Check times*/
+        if ((ts[0].tv_nsec < 0 || ts[0].tv_nsec >= 1000000000) ||
+            (ts[1].tv_nsec < 0 || ts[1].tv_nsec >= 1000000000)) {
+            *errnoptr = EINVAL;
+            unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+            return -1;
+        }
     }
 
-    /*Truncate*/
-    if (offset < file_inode->size) {
-        if (!offset) {
-            /*Truncate file to zero size by freeing data block*/
-            if (file_inode->data_block) {
-                if (free_data_block(fsptr, fssize, file_inode->data_block)) {
-                    *errnoptr = EIO;
-                    return -1;
-                }
-                file_inode->data_block = 0;
-            }
-        } else {
-            /*Truncate existing dblock*/
-            if (!file_inode->data_block) {
-                *errnoptr = EIO;
-                return -1;
-            }
+    /*Update times, dropping any held back access time*/
+    flush_atime(fsptr, fssize, ctx, file_inode, inode_offset);
+    file_inode->access_time = new_access_time;
+    file_inode->modification_time = new_modification_time;
+    file_inode->change_time = time(NULL); 
 
-            /*Ccheck offset is<BLOCK_SIZE*/
-            if ((size_t)offset > BLOCK_SIZE) {
-                *errnoptr = EFBIG;
-                return -1;
-            }
+    /*Success*/
+    unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    return 0;
+}
 
-            /*Get offset to datablock*/
-            void *data_ptr = offset_to_ptr(fsptr, fssize, file_inode->data_block + offset);
-            if (!data_ptr) {
-                *errnoptr = EIO;
-                return -1;
-            }
+/* Implements an emulation of the utimensat system call on the filesystem 
+   of size fssize pointed to by fsptr.
 
-            /*Zero fill bytes*/
-            size_t bytes_to_zero = file_inode->size - offset;
-            memset(data_ptr, 0, bytes_to_zero);
-        }
+   The call changes the access and modification times of the file
+   or directory indicated by path to the values in ts.
 
-        /*Update inode size*/
-        file_inode->size = offset;
-        /*Time to update the time*/
-        file_inode->modification_time = file_inode->change_time = time(NULL);
+   On success, 0 is returned.
 
-        return 0;
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 utimensat.
+
+*/
+int __myfs_utimens_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, const char *path, const struct timespec ts[2]) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
+        return -1;
     }
 
-    /*Truncate to bigger size*/
-    if (offset > file_inode->size) {
-        /*File is too big*/
-        if ((size_t)offset > BLOCK_SIZE) {
-            *errnoptr = EFBIG;
-            return -1;
-        }
+    /*Check path*/
+    if (!path|| !strlen(path)) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
 
-        /*Allocate dblock*/
-        if (!file_inode->data_block) {
-            size_t data_block_offset = find_free_data_block(fsptr, fssize);
-            if (data_block_offset == (size_t)-1) {
-                *errnoptr = ENOSPC;
-                return -1;
-            }
+    /*Find inode for path*/
+    uint64_t ino = path_to_ino(fsptr, fssize, ctx, path, strlen(path));
+    if (!ino) {
+        *errnoptr = path_error(path, strlen(path));
+        return -1;
+    }
 
-            /*Mark the dblock as used*/
-            fs_info_block *info_block = (fs_info_block*)fsptr;
-            uint8_t *data_bitmap = (uint8_t*)offset_to_ptr(fsptr, fssize, info_block->free_block_bitmap);
-            if (data_bitmap) {
-                size_t block_num = (data_block_offset - info_block->data_blocks) / BLOCK_SIZE;
-                if (block_num >= MAX_DATA_BLOCKS) {
-                    free_data_block(fsptr, fssize, data_block_offset);
-                    *errnoptr = EIO;
-                    return -1;
-                }
-                data_bitmap[block_num / 8] |= (1 << (block_num % 8));
-            } else {
-                /*Unable to access dblock bitmap*/
-                free_data_block(fsptr, fssize, data_block_offset);
-                *errnoptr = EIO;
-                return -1;
-            }
+    return __myfs_utimens_ino_implem(fsptr, fssize, ctx, errnoptr, ino, ts);
+}
 
-            /*Init the dblock*/
-            void *data_ptr = offset_to_ptr(fsptr, fssize, data_block_offset);
-            if (!data_ptr) {
-                free_data_block(fsptr, fssize, data_block_offset);
-                *errnoptr = EIO;
-                return -1;
-            }
+/* Implements an emulation of the statfs system call on the filesystem 
+   of size fssize pointed to by fsptr.
 
-            /*Zero fill the block*/
-            memset(data_ptr, 0, BLOCK_SIZE);
+   The call gets information of the filesystem usage and puts in 
+   into stbuf.
 
-            /*Assign dblock to inode*/
-            file_inode->data_block = data_block_offset;
-        }
+   On success, 0 is returned.
 
-        /*Get pointer to dblock*/
-        void *data_ptr = offset_to_ptr(fsptr, fssize, file_inode->data_block);
-        if (!data_ptr) {
-            *errnoptr = EIO;
-            return -1;
-        }
+   On failure, -1 is returned and *errnoptr is set appropriately.
 
-        /*Get num bytes to 0 fill*/
-        size_t bytes_to_zero = offset - file_inode->size;
-        if ((size_t)offset > BLOCK_SIZE) {
-            *errnoptr = EFBIG;
-            return -1;
-        }
+   The error codes are documented in man 2 statfs.
 
-        /*0 fill ext bytes*/
-        memset((char*)data_ptr + file_inode->size, 0, bytes_to_zero);
+   Essentially, only the following fields of struct statvfs need to be
+   supported:__myfs_utimens_implem
+   f_bsize   fill with what you call a block (typically 1024 bytes)
+   f_blocks  fill with the total number of blocks in the filesystem
+   f_bfree   fill with the free number of blocks in the filesystem
+   f_bavail  fill with same value as f_bfree
+   f_namemax fill with your maximum file/directory name, if your
+             filesystem has such a maximum
 
-        /*Update size*/
-        file_inode->size = offset;
-        /*Update time*/
-        file_inode->modification_time = file_inode->change_time = time(NULL);
-        /*All good*/
-        return 0;
+*/
+int __myfs_statfs_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, struct statvfs* stbuf) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT; 
+        return -1;
+    }
+
+    /*Check stat buffer*/
+    if (!stbuf) {
+        *errnoptr = EFAULT;
+        return -1;
     }
 
-    /*Nothing to do, nothing to see, so everything's wrong with taking the backstreets*/
+    /*0 stbuf*/
+    memset(stbuf, 0, sizeof(struct statvfs));
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+
+    /*Populate fields */
+    stbuf->f_bsize = BLOCK_SIZE;
+    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_blocks = calculate_total_blocks(fsptr, fssize);
+    stbuf->f_files = info_block->max_inodes;
+    lock_alloc(fsptr, fssize, ctx);
+    stbuf->f_bfree = info_block->free_blocks;
+    stbuf->f_ffree = info_block->free_inodes;
+    unlock_alloc(fsptr, fssize, ctx);
+    stbuf->f_bavail = stbuf->f_bfree; 
+    stbuf->f_favail = stbuf->f_ffree;
+    stbuf->f_namemax = MAX_FILENAME;
+
+    /*Success*/
     return 0;
 }
 
+/* Implements the work done once when the filesystem of size fssize
+   pointed to by fsptr is mounted, before any other call.
 
-/* Implements an emulation of the open system call on the filesystem 
-   of size fssize pointed to by fsptr, without actually performing the opening
-   of the file (no file descriptor is returned).
+   The filesystem is formatted if it is new. The free block and free
+   inode counters are rebuilt from the bitmaps, so they are right even
+   if the image was not cleanly unmounted. Every other call just keeps
+   them up to date.
 
-   The call just checks if the file (or directory) indicated by path
-   can be accessed, i.e. if the path can be followed to an existing
-   object for which the access rights are granted.
+   The locks and settings of the mount live in a context on the heap,
+   never in the image. *ctxptr gets it, to be handed to every other call
+   until __myfs_unmount_implem frees it. No other call may run before
+   this one returns.
 
    On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The two only interesting error codes are 
-
-   * EFAULT: the filesystem is in a bad state, we can't do anything
-
-   * ENOENT: the file that we are supposed to open doesn't exist (or a
-             subpath).
-
-   It is possible to restrict ourselves to only these two error
-   conditions. It is also possible to implement more detailed error
-   condition answers.
-
-   The error codes are documented in man 2 open.
-
 */
-int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+int __myfs_mount_implem(void *fsptr, size_t fssize, fs_context **ctxptr, int *errnoptr) {
+    /*Locks and settings of this mount*/
+    fs_context *ctx = (fs_context*)calloc(1, sizeof(fs_context));
+    if (!ctx || init_context(ctx)) {
+        free(ctx);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+
     /*Init FS*/
-    if (!init_fs(fsptr, fssize)) {
+    if (!init_fs(fsptr, fssize, ctx)) {
+        free_context(ctx);
         *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Check path input */
-    if (!path ||!strlen(path)) {
-        *errnoptr = EINVAL;
+    /*Empty dentry cache, no file open*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    ctx->open_counts = (uint32_t*)calloc(info_block->max_inodes, sizeof(uint32_t));
+    if (!ctx->open_counts || init_dcache(fsptr, fssize, ctx)) {
+        free_context(ctx);
+        *errnoptr = ENOMEM;
         return -1;
     }
 
-    /*searching dor inode*/
-    size_t inode_offset;
-    inode *file_inode = find_inode(fsptr, fssize, path, &inode_offset);
-    if (!file_inode) {
-        *errnoptr = ENOENT;
+    /*Redo what a crash left in the journal, before counting*/
+    if (journal_replay(fsptr, fssize, ctx)) {
+        free_context(ctx);
+        *errnoptr = EIO;
         return -1;
     }
 
-    /*Check dir integrity*/
-    if (file_inode->mode & S_IFDIR) {
-        directory_entry *entries = (directory_entry *)offset_to_ptr(fsptr, fssize, file_inode->data_block);
-        if (!entries) {
-            *errnoptr = EIO; 
-            return -1;
-        }
-
-        size_t num_entries = file_inode->size / sizeof(directory_entry);
-        if (num_entries < 2) {
-            *errnoptr = EIO; 
-            return -1;
-        }
+    /*After a crash, only what the root reaches is in use*/
+    if (!info_block->clean && repair_bitmaps(fsptr, fssize, ctx)) {
+        free_context(ctx);
+        *errnoptr = ENOMEM;
+        return -1;
     }
 
-    /*All good*/
+    /*Recount what's free*/
+    info_block->free_blocks = calculate_free_blocks(fsptr, fssize);
+    info_block->free_inodes = calculate_free_inodes(fsptr, fssize);
+
+    /*Dirty until unmounted*/
+    ctx->was_clean = info_block->clean;
+    info_block->clean = 0;
+
+    /*Ready to go*/
+    *ctxptr = ctx;
     return 0;
 }
 
-/* Implements an emulation of the read system call on the filesystem 
-   of size fssize pointed to by fsptr.
+/* Reports how many lookups the dentry cache answered (*hits), how many
+   of those were for missing names (*negative_hits) and how many had to
+   search a directory (*misses) since the file-system was mounted, to see
+   whether the cache is big enough.
 
-   The call copies up to size bytes from the file indicated by 
-   path into the buffer, starting to read at offset. See the man page
-   for read for the details when offset is beyond the end of the file etc.
-   
-   On success, the appropriate number of bytes read into the buffer is
-   returned. The value zero is returned on an end-of-file condition.
+   On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 read.
-
 */
-int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, char *buf, size_t size, off_t offset) {
-    /*Init fs*/
-    if (!init_fs(fsptr, fssize)) {
-        *errnoptr = EFAULT; 
+int __myfs_dcache_stats_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t *hits, uint64_t *negative_hits, uint64_t *misses) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Check path and buff*/
-    if (!path || !buf) {
-        *errnoptr = EINVAL;
-        return -1;
+
+    /*Sum the stripes*/
+    *hits = *negative_hits = *misses = 0;
+    for (int i = 0; i < DCACHE_STRIPES; i++) {
+        dcache_stripe *stripe = &ctx->dcache_stripes[i];
+        pthread_mutex_lock(&stripe->lock);
+        *hits += stripe->hits;
+        *negative_hits += stripe->negative_hits;
+        *misses += stripe->misses;
+        pthread_mutex_unlock(&stripe->lock);
     }
+    return 0;
+}
 
-    /*Find inode for path*/
-    size_t inode_offset;
-    inode *file_inode = find_inode(fsptr, fssize, path, &inode_offset);
-    if (!file_inode) {
-        *errnoptr = ENOENT;
+/* Sets when reads update the access time of a node, for the mount on
+   the file-system of size fssize pointed to by fsptr. It is called once
+   after __myfs_mount_implem. The mode is one of
+
+   * ATIME_ALWAYS: every read stores the time (the default)
+
+   * ATIME_RELATIME: a read stores it only if the access time is not
+                     newer than the last modification or change, or is
+                     a day old
+
+   * ATIME_NEVER: reads never store it
+
+   With lazy non-zero, access times are held back in memory instead of
+   being stored into the inodes, so reads leave the image untouched.
+   They reach the inodes once the node is written for another reason,
+   on __myfs_flush_times_implem or on __myfs_unmount_implem.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+*/
+int __myfs_atime_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, int mode, int lazy) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Check inode is file*/
-    if (!(file_inode->mode & S_IFREG)) {
+
+    /*Unknown mode*/
+    if (mode != ATIME_ALWAYS && mode != ATIME_RELATIME && mode != ATIME_NEVER) {
         *errnoptr = EINVAL;
         return -1;
     }
 
-    /*Handle beyond EOF*/
-    if (offset >= (off_t)file_inode->size) {
-        return 0;
+    /*Room for every inode and the root*/
+    if (lazy && !ctx->lazy_atimes) {
+        fs_info_block *info_block = (fs_info_block*)fsptr;
+        ctx->lazy_atimes = calloc(info_block->max_inodes + 1, sizeof(time_t));
+        if (!ctx->lazy_atimes) {
+            *errnoptr = ENOMEM;
+            return -1;
+        }
     }
 
-    /*Check bytes to read*/
-    size_t bytes_available = file_inode->size - offset;
-    size_t bytes_to_read = (size < bytes_available) ? size : bytes_available;
+    ctx->atime_mode = mode;
+    return 0;
+}
 
-    /*Check file has dblockk alloc'd*/
-    if (!file_inode->data_block) {
-        *errnoptr = EIO;
+/* Stores the access times held back by lazytime into their inodes, in
+   one batch, e.g. before the image is synced to its backup file.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+*/
+int __myfs_flush_times_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Check offset not bigger than block size*/
-    if ((size_t)offset > BLOCK_SIZE) {
-        *errnoptr = EINVAL;
-        return -1;
+    if (!ctx->lazy_atimes) return 0;
+
+    /*Each node with a held back time, locked shared like a read*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    for (size_t slot = 0; slot <= info_block->max_inodes; slot++) {
+        if (!__atomic_load_n(&ctx->lazy_atimes[slot], __ATOMIC_RELAXED)) continue;
+        size_t inode_offset = (slot == info_block->max_inodes) ? info_block->root_inode : info_block->inode_table + slot * INODE_SIZE;
+        inode *node = (inode*)offset_to_ptr(fsptr, fssize, inode_offset);
+        if (!node) continue;
+        lock_inodes(fsptr, fssize, ctx, &inode_offset, 1, 0);
+        flush_atime(fsptr, fssize, ctx, node, inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
     }
+    return 0;
+}
 
-    /*Get ptr to dblock at specified offset*/
-    void *data_ptr = offset_to_ptr(fsptr, fssize, file_inode->data_block + offset);
-    if (!data_ptr) {
-        *errnoptr = EIO;
+/* Turns on dirty tracking for the mount on the file-system of size
+   fssize pointed to by fsptr, so __myfs_sync_implem only hands out the
+   blocks written since they were last synced. It is called once after
+   __myfs_mount_implem. If the image was cleanly unmounted, only the
+   metadata the mount rewrote starts out dirty. Otherwise an
+   earlier run may have left any page dirty, so the whole image does, but
+   is not due for __myfs_writeback_implem.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+*/
+int __myfs_track_dirty_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Copy data into user-provided buffer*/
-    memcpy(buf, data_ptr, bytes_to_read);
+    if (ctx->dirty_blocks) return 0;
 
-    /*Update inode's access time*/
-    file_inode->access_time = time(NULL);
+    /*A bit per block*/
+    size_t words = ((fssize + BLOCK_SIZE - 1) / BLOCK_SIZE + 63) / 64;
+    uint64_t *dirty_blocks = calloc(words, sizeof(uint64_t));
+    uint64_t *writeback_blocks = calloc(words, sizeof(uint64_t));
+    if (!dirty_blocks || !writeback_blocks) {
+        free(dirty_blocks);
+        free(writeback_blocks);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    ctx->writeback_blocks = writeback_blocks;
+    ctx->dirty_blocks = dirty_blocks;
 
-    /*Ret byts read*/
-    return (int)bytes_to_read;
+    /*On a clean image only the metadata the mount wrote is dirty.
+      Otherwise all of it is, though writes before now are the kernel's
+      to write back.*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    if (ctx->was_clean) mark_dirty(fsptr, fssize, ctx, 0, info_block->data_blocks);
+    else memset(dirty_blocks, 0xff, words * sizeof(uint64_t));
+    return 0;
 }
 
-/* Implements an emulation of the write system call on the filesystem 
-   of size fssize pointed to by fsptr.
+/* Hands the parts of the file-system of size fssize pointed to by fsptr
+   that must reach stable storage to fn, as ranges of whole blocks.
 
-   The call copies up to size bytes to the file indicated by 
-   path into the buffer, starting to write at offset. See the man page
-   for write for the details when offset is beyond the end of the file etc.
-   
-   On success, the appropriate number of bytes written into the file is
-   returned. The value zero is returned on an end-of-file condition.
+   With ino 0 the whole file-system is synced: every dirty block goes to
+   fn and counts as clean afterwards. Writers are held off meanwhile.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+   Otherwise only the node with inode number ino is synced, as for fsync:
+   its data, and the blocks of inodes, bitmaps and info block it may have
+   changed. The node is held locked shared meanwhile. With the journal on,
+   the metadata is made durable by flushing the journal instead, and only
+   the node's data goes to fn.
 
-   The error codes are documented in man 2 write.
+   Without dirty tracking the whole image is handed to fn at once.
 
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately. Blocks
+   fn failed on stay dirty.
 */
-int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, const char *buf, size_t size, off_t offset) {
-    /*Init fs*/
-    if (!init_fs(fsptr, fssize)) {
-        *errnoptr = EFAULT; 
+int __myfs_sync_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, uint64_t ino, sync_callback fn, void *arg) {
+    /*Init FS*/
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Find file inode*/
-    size_t inode_offset;
-    inode *file_inode = find_inode(fsptr, fssize, path, &inode_offset);
-    if (!file_inode) {
-        *errnoptr = ENOENT;
-        return -1;
-    }
 
-    /*Check if file*/
-    if (!(file_inode->mode & S_IFREG)) {
-        *errnoptr = EINVAL; 
+    /*Nothing tracked, everything goes*/
+    if (!ctx->dirty_blocks) {
+        if (!fn(arg, 0, fssize)) return 0;
+        *errnoptr = EIO;
         return -1;
     }
 
-    /*Alloc dblock*/
-    if (file_inode->data_block == 0) {
-        size_t data_block_offset = find_free_data_block(fsptr, fssize);
-        if (data_block_offset == (size_t)-1) {
-                *errnoptr = ENOSPC;
-                return -1;
+    /*One node*/
+    int res;
+    if (ino) {
+        size_t inode_offset;
+        inode *node = lock_ino(fsptr, fssize, ctx, ino, 0, &inode_offset);
+        if (!node) {
+            *errnoptr = ENOENT;
+            return -1;
         }
-        file_inode->data_block = data_block_offset;
-    }
+        if (ctx->journal_on) res = sync_node_blocks(fsptr, fssize, ctx, node, fn, arg);
+        else res = sync_node(fsptr, fssize, ctx, node, inode_offset, fn, arg);
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
 
-    /*Get offset to dblock*/
-    void *data_ptr = offset_to_ptr(fsptr, fssize, file_inode->data_block + offset);
-    if (!data_ptr) {
-        *errnoptr = EIO;
-        return -1;
+        /*Data first, then the metadata pointing at it*/
+        if (!res && ctx->journal_on) res = journal_commit(fsptr, fssize, ctx);
+    } else {
+        /*Every stripe shared, in the order lock_inodes takes them. With the
+          journal this is a checkpoint, it empties the journal.*/
+        for (int i = 0; i < LOCK_STRIPES; i++) pthread_rwlock_rdlock(&ctx->inode_locks[i]);
+        if (ctx->journal_on) {
+            pthread_mutex_lock(&ctx->journal_lock);
+            res = journal_checkpoint(fsptr, fssize, ctx, fn, arg);
+            pthread_mutex_unlock(&ctx->journal_lock);
+        } else {
+            res = sync_blocks(fsptr, fssize, ctx, 0, (size_t)-1, 1, fn, arg);
+        }
+        for (int i = 0; i < LOCK_STRIPES; i++) pthread_rwlock_unlock(&ctx->inode_locks[i]);
     }
 
-    /*Check if write > block size*/
-    if (offset + size > BLOCK_SIZE) {
-        *errnoptr = EFBIG; // File too large
+    if (res) *errnoptr = EIO;
+    return res;
+}
+
+/* Ends the mount of the file-system of size fssize pointed to by fsptr,
+   storing held back access times and freeing the context of the mount.
+   With the journal on, everything is checkpointed first. Dirty tracking
+   and journaling end with it, the caller syncs the whole image.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+*/
+int __myfs_unmount_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr) {
+    if (!ctx) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Write to buf*/
-    memcpy(data_ptr, buf, size);
+    /*Files unlinked while open are freed, no one releases them anymore*/
+    fs_info_block *info_block = (fs_info_block*)fsptr;
+    for (size_t n = 0; n < info_block->max_inodes; n++) {
+        if (!ctx->open_counts[n]) continue;
+        size_t inode_offset = info_block->inode_table + n * INODE_SIZE;
+        inode *node = (inode*)((char*)fsptr + inode_offset);
+        lock_inodes(fsptr, fssize, ctx, &inode_offset, 1, 1);
+        ctx->open_counts[n] = 0;
+        if (node->mode && !node->nlink) destroy_inode(fsptr, fssize, ctx, inode_offset);
+        unlock_inodes(fsptr, fssize, ctx, &inode_offset, 1);
+    }
 
-    /*Update metadata*/
-    if (offset + size > file_inode->size) file_inode->size = offset + size;
-    file_inode->modification_time = file_inode->change_time = time(NULL);
+    int res = __myfs_flush_times_implem(fsptr, fssize, ctx, errnoptr);
 
-    /*Return bytes written*/
-    return size;
-}
+    /*Checkpoint, so the next mount finds the journal empty. If that fails
+      the next mount replays it.*/
+    if (ctx->journal_on) {
+        if (!res) res = __myfs_sync_implem(fsptr, fssize, ctx, errnoptr, 0, ctx->journal_sync, ctx->journal_arg);
+        ctx->journal_on = 0;
+        pthread_key_delete(ctx->journal_key);
+    }
 
+    /*Left clean once the caller syncs the image*/
+    if (!res) ((fs_info_block*)fsptr)->clean = 1;
 
-/* Implements an emulation of the utimensat system call on the filesystem 
-   of size fssize pointed to by fsptr.
+    /*The context goes either way*/
+    free_context(ctx);
+    return res;
+}
 
-   The call changes the access and modification times of the file
-   or directory indicated by path to the values in ts.
+/* Turns on the metadata journal for the mount on the file-system of size
+   fssize pointed to by fsptr. It is called once after
+   __myfs_track_dirty_implem. From then on every call that changes
+   metadata logs the inodes, directory entries, extents and bitmap bits it
+   changed as one transaction to the journal, a ring in the image. fn is
+   how the journal and, when it fills up, every dirty block are written
+   back. An fsync then flushes the journal in one sequential write instead
+   of the scattered metadata blocks, and concurrent fsyncs share the flush.
+   After a crash __myfs_mount_implem redoes the logged transactions.
 
    On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 utimensat.
-
 */
-int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, const struct timespec ts[2]) {
+int __myfs_journal_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, sync_callback fn, void *arg) {
     /*Init FS*/
-    if (!init_fs(fsptr, fssize)) {
+    if (!init_fs(fsptr, fssize, ctx)) {
         *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Check path*/
-    if (!path|| !strlen(path)) {
+    if (ctx->journal_on) return 0;
+
+    /*Checkpoints need to know what's dirty*/
+    if (!ctx->dirty_blocks || !fn) {
         *errnoptr = EINVAL;
         return -1;
     }
 
-    /*Find inode for path*/
-    size_t inode_offset;
-    inode *file_inode = find_inode(fsptr, fssize, path, &inode_offset);
-    if (!file_inode) {
-        *errnoptr = ENOENT;
+    /*A thread's transaction is freed when it exits*/
+    if (pthread_key_create(&ctx->journal_key, journal_txn_free)) {
+        *errnoptr = ENOMEM;
         return -1;
     }
-
-    /*update acces and mod times*/
-    time_t new_access_time;
-    time_t new_modification_time;
-
-    /*Ts is null, assign curr time*/
-    if (!ts) {
-        new_access_time = new_modification_time = time(NULL);
-    } else {
-        /*Set times vased on array*/
-        new_access_time = ts[0].tv_sec;
-        new_modification_time = ts[1].tv_sec;
-
-        /*Check times*/
-        if ((ts[0].tv_nsec < 0 || ts[0].tv_nsec >= 1000000000) ||
-            (ts[1].tv_nsec < 0 || ts[1].tv_nsec >= 1000000000)) {
-            *errnoptr = EINVAL;
-            return -1;
-        }
-    }
-
-    /*Update times*/
-    file_inode->access_time = new_access_time;
-    file_inode->modification_time = new_modification_time;
-    file_inode->change_time = time(NULL); 
-
-    /*Success*/
+    ctx->journal_sync = fn;
+    ctx->journal_arg = arg;
+    ctx->journal_on = 1;
     return 0;
 }
 
-/* Implements an emulation of the statfs system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call gets information of the filesystem usage and puts in 
-   into stbuf.
+/* Starts background writeback of the blocks of the file-system of size
+   fssize pointed to by fsptr written since their writeback was last
+   started. It needs dirty tracking, and is meant to be called
+   periodically by a single flusher thread. Runs of such blocks go to fn,
+   which should only start writing them back, not wait for it, beginning
+   where the previous call stopped and wrapping around the image once.
+   The call ends once max_bytes were handed out, so each call is bounded
+   and a later one picks up the rest.
+
+   Blocks stay dirty for __myfs_sync_implem, which still has to wait for
+   them, but will mostly find them written back already.
+
+   With the journal on, the journal is committed first, with every inode
+   lock taken shared so that no call is halfway through its changes.
+   The locks are dropped before any block is handed out. That keeps the
+   flusher from pushing metadata ahead of the transactions logged so far,
+   but can't keep later changes out of the pages: the image is mapped
+   shared, so the kernel may write any page back at any time, and fn
+   only captures a page once its writeback starts.
 
    On success, 0 is returned.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 statfs.
-
-   Essentially, only the following fields of struct statvfs need to be
-   supported:__myfs_utimens_implem
-   f_bsize   fill with what you call a block (typically 1024 bytes)
-   f_blocks  fill with the total number of blocks in the filesystem
-   f_bfree   fill with the free number of blocks in the filesystem
-   f_bavail  fill with same value as f_bfree
-   f_namemax fill with your maximum file/directory name, if your
-             filesystem has such a maximum
-
+   On failure, -1 is returned and *errnoptr is set appropriately. Blocks
+   fn failed on are handed out again by the next call.
 */
-int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs* stbuf) {
+int __myfs_writeback_implem(void *fsptr, size_t fssize, fs_context *ctx, int *errnoptr, size_t max_bytes, sync_callback fn, void *arg) {
     /*Init FS*/
-    if (!init_fs(fsptr, fssize)) {
-        *errnoptr = EFAULT; 
+    if (!init_fs(fsptr, fssize, ctx)) {
+        *errnoptr = EFAULT;
         return -1;
     }
 
-    /*Check stat buffer*/
-    if (!stbuf) {
-        *errnoptr = EFAULT;
+    if (!ctx->dirty_blocks || !fn) {
+        *errnoptr = EINVAL;
         return -1;
     }
 
-    /*0 stbuf*/
-    memset(stbuf, 0, sizeof(struct statvfs));
+    /*Every transaction so far is logged and committed first*/
+    if (ctx->journal_on) {
+        for (int i = 0; i < LOCK_STRIPES; i++) pthread_rwlock_rdlock(&ctx->inode_locks[i]);
+        journal_make_room(fsptr, fssize, ctx);
+        int res = journal_commit(fsptr, fssize, ctx);
+        for (int i = 0; i < LOCK_STRIPES; i++) pthread_rwlock_unlock(&ctx->inode_locks[i]);
+        if (res) {
+            *errnoptr = EIO;
+            return -1;
+        }
+    }
 
-    /*Populate fields */
-    stbuf->f_bsize = BLOCK_SIZE;
-    stbuf->f_frsize = BLOCK_SIZE;
-    stbuf->f_blocks = calculate_total_blocks(fssize);
-    stbuf->f_bfree = calculate_free_blocks(fsptr, fssize);
-    stbuf->f_bavail = stbuf->f_bfree; 
-    stbuf->f_namemax = MAX_FILENAME;
+    size_t num_blocks = (fssize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t *bits = ctx->writeback_blocks;
+    size_t b = ctx->writeback_cursor < num_blocks ? ctx->writeback_cursor : 0;
+    size_t left = num_blocks;
+    int res = 0;
+    while (left && max_bytes) {
+        /*Skip clean words whole, wrapping at the end of the image*/
+        uint64_t word = __atomic_load_n(&bits[b / 64], __ATOMIC_RELAXED) >> (b % 64);
+        if (!word) {
+            size_t next = (b / 64 + 1) * 64;
+            if (next >= num_blocks) next = num_blocks;
+            left = (left > next - b) ? left - (next - b) : 0;
+            b = (next == num_blocks) ? 0 : next;
+            continue;
+        }
+        size_t skip = __builtin_ctzll(word);
+        if (skip >= left) break;
+        b += skip;
+        left -= skip;
+
+        /*Take the run, as far as the budget goes*/
+        size_t end = b;
+        while (end < num_blocks && end - b < left && (end - b) * BLOCK_SIZE < max_bytes &&
+               (__atomic_load_n(&bits[end / 64], __ATOMIC_RELAXED) >> (end % 64) & 1)) {
+            __atomic_fetch_and(&bits[end / 64], ~(1ULL << (end % 64)), __ATOMIC_RELAXED);
+            end++;
+        }
 
-    /*Success*/
-    return 0;
+        /*A sync took the block since the word was loaded, fn would take
+          a length of 0 for the rest of the file*/
+        if (end == b) continue;
+
+        size_t offset = b * BLOCK_SIZE, len = (end - b) * BLOCK_SIZE;
+        if (len > fssize - offset) len = fssize - offset;
+        left -= end - b;
+        max_bytes = (max_bytes > len) ? max_bytes - len : 0;
+        b = (end == num_blocks) ? 0 : end;
+        if (fn(arg, offset, len)) {
+            for (size_t n = offset / BLOCK_SIZE; n < end; n++) {
+                __atomic_fetch_or(&bits[n / 64], 1ULL << (n % 64), __ATOMIC_RELAXED);
+            }
+            *errnoptr = EIO;
+            res = -1;
+            break;
+        }
+    }
+    ctx->writeback_cursor = b;
+    return res;
 }
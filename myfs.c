@@ -41,8 +41,13 @@
 */
 
 #define FUSE_USE_VERSION 26
+/* For sync_file_range */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -54,11 +59,26 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <time.h>
 
 
 struct __myfs_options_struct_t {
         const char *filename;
         const char *size;
+        const char *entry_timeout;
+        const char *attr_timeout;
+        const char *negative_timeout;
+        const char *flush_interval;
+        const char *flush_rate;
+        int kernel_cache;
+        int big_writes;
+        int stats;
+        int noatime;
+        int relatime;
+        int lazytime;
+        int lowlevel;
         int show_help;
 };
 
@@ -67,6 +87,18 @@ struct __myfs_options_struct_t {
 static const struct fuse_opt __myfs_option_spec[] = {
         OPTION("--backupfile=%s", filename),
         OPTION("--size=%s", size),
+        OPTION("--entry-timeout=%s", entry_timeout),
+        OPTION("--attr-timeout=%s", attr_timeout),
+        OPTION("--negative-timeout=%s", negative_timeout),
+        OPTION("--flush-interval=%s", flush_interval),
+        OPTION("--flush-rate=%s", flush_rate),
+        OPTION("--kernel-cache", kernel_cache),
+        OPTION("--big-writes", big_writes),
+        OPTION("--stats", stats),
+        OPTION("--noatime", noatime),
+        OPTION("--relatime", relatime),
+        OPTION("--lazytime", lazytime),
+        OPTION("--lowlevel", lowlevel),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -78,19 +110,110 @@ struct __memory_block_struct_t {
 };
 typedef struct __memory_block_struct_t memory_block_t;
 
+/* Locks and settings of a mount, set up by the implementation and kept
+   out of the image */
+typedef struct __myfs_context_struct_t myfs_context_t;
+
 struct __myfs_environment_struct_t {
-  pthread_mutex_t env_lock;
   uid_t           uid;
   gid_t           gid;
   void            *memory;
   size_t          size;
   int             using_backup;
   int             backup_fd;
+  double          entry_timeout;
+  double          attr_timeout;
+  double          negative_timeout;
+  int             kernel_cache;
+  int             big_writes;
+  int             stats;
+  int             atime;
+  int             lazytime;
+  myfs_context_t  *context;
+  struct fuse_chan *chan;
+  double          flush_interval;
+  size_t          flush_rate;
+  int             flusher_running;
+  int             flusher_stop;
+  pthread_t       flusher;
+  pthread_mutex_t flusher_lock;
+  pthread_cond_t  flusher_cond;
 };
 
 #define MYFS_DEFAULT_SIZE  ((size_t) (128 << 20))   /* 128MB */
 #define MYFS_MIN_SIZE      ((size_t) (2048))        /* 2kB */
 
+/* Seconds the kernel may cache entries, attributes and failed
+   lookups for, the FUSE library's defaults */
+#define MYFS_DEFAULT_ENTRY_TIMEOUT     1.0
+#define MYFS_DEFAULT_ATTR_TIMEOUT      1.0
+#define MYFS_DEFAULT_NEGATIVE_TIMEOUT  0.0
+
+/* When reads update access times, the values implementation.c takes */
+#define MYFS_ATIME_ALWAYS    0
+#define MYFS_ATIME_RELATIME  1
+#define MYFS_ATIME_NEVER     2
+
+/* Background writeback of a backup-file: every this many seconds, at most
+   this many bytes per second of the blocks written since the last round
+   are handed to the kernel to write back */
+#define MYFS_DEFAULT_FLUSH_INTERVAL  5.0
+#define MYFS_DEFAULT_FLUSH_RATE      ((size_t) (32 << 20))  /* 32MB/s */
+
+/* Largest write asked for with --big-writes. libfuse 2 receives
+   requests into buffers of 128kB of payload and caps max_write to it. */
+#define MYFS_MAX_WRITE     ((unsigned) (128 << 10))  /* 128kB */
+
+/* Declaration for the implementations of the operations */
+
+int __myfs_getattr_implem(void *, size_t, myfs_context_t *, int *, uid_t, gid_t, const char *, struct stat *);
+int __myfs_readdir_implem(void *, size_t, myfs_context_t *, int *, const char *, char ***);
+int __myfs_readdir_stream_implem(void *, size_t, myfs_context_t *, int *, const char *, off_t,
+                                 int (*)(void *, const char *, const struct stat *, off_t), void *);
+int __myfs_mknod_implem(void *, size_t, myfs_context_t *, int *, const char *);
+int __myfs_unlink_implem(void *, size_t, myfs_context_t *, int *, const char *);
+int __myfs_mkdir_implem(void *, size_t, myfs_context_t *, int *, const char *);
+int __myfs_rmdir_implem(void *, size_t, myfs_context_t *, int *, const char *);
+int __myfs_rename_implem(void *, size_t, myfs_context_t *, int *, const char *, const char*);
+int __myfs_truncate_implem(void *, size_t, myfs_context_t *, int *, const char *, off_t);
+int __myfs_open_implem(void *, size_t, myfs_context_t *, int *, const char *);
+int __myfs_open_fh_implem(void *, size_t, myfs_context_t *, int *, const char *, uint64_t *);
+int __myfs_create_implem(void *, size_t, myfs_context_t *, int *, const char *, uint64_t *);
+int __myfs_dcache_stats_implem(void *, size_t, myfs_context_t *, int *, uint64_t *, uint64_t *, uint64_t *);
+int __myfs_read_implem(void *, size_t, myfs_context_t *, int *, const char *, char *, size_t, off_t);
+int __myfs_write_implem(void *, size_t, myfs_context_t *, int *, const char *, const char *, size_t, off_t);
+int __myfs_statfs_implem(void *, size_t, myfs_context_t *, int *, struct statvfs*);
+int __myfs_utimens_implem(void *, size_t, myfs_context_t *, int *, const char *, const struct timespec [2]);
+int __myfs_mount_implem(void *, size_t, myfs_context_t **, int *);
+int __myfs_atime_implem(void *, size_t, myfs_context_t *, int *, int, int);
+int __myfs_flush_times_implem(void *, size_t, myfs_context_t *, int *);
+int __myfs_unmount_implem(void *, size_t, myfs_context_t *, int *);
+int __myfs_track_dirty_implem(void *, size_t, myfs_context_t *, int *);
+int __myfs_sync_implem(void *, size_t, myfs_context_t *, int *, uint64_t, int (*)(void *, size_t, size_t), void *);
+int __myfs_journal_implem(void *, size_t, myfs_context_t *, int *, int (*)(void *, size_t, size_t), void *);
+int __myfs_writeback_implem(void *, size_t, myfs_context_t *, int *, size_t, int (*)(void *, size_t, size_t), void *);
+
+int __myfs_lookup_implem(void *, size_t, myfs_context_t *, int *, uid_t, gid_t, uint64_t, const char *, struct stat *);
+int __myfs_getattr_ino_implem(void *, size_t, myfs_context_t *, int *, uid_t, gid_t, uint64_t, struct stat *);
+int __myfs_readdir_stream_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, off_t,
+                                     int (*)(void *, const char *, const struct stat *, off_t), void *);
+int __myfs_mknod_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, const char *, struct stat *);
+int __myfs_unlink_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, const char *);
+int __myfs_mkdir_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, const char *, struct stat *);
+int __myfs_rmdir_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, const char *);
+int __myfs_rename_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, const char *, uint64_t, const char *);
+int __myfs_truncate_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, off_t);
+int __myfs_open_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t);
+int __myfs_open_keep_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t);
+int __myfs_release_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t);
+int __myfs_read_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, char *, size_t, off_t);
+int __myfs_write_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, const char *, size_t, off_t);
+int __myfs_utimens_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, const struct timespec [2]);
+int __myfs_read_runs_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, size_t, off_t,
+                                ssize_t (*)(void *, const struct iovec *, int), void *);
+int __myfs_write_runs_ino_implem(void *, size_t, myfs_context_t *, int *, uint64_t, size_t, off_t,
+                                 ssize_t (*)(void *, const struct iovec *, int), void *);
+
 static int __myfs_parse_size(size_t *size, const char *str) {
   unsigned long long int tmp, t;
   size_t s;
@@ -106,6 +229,22 @@ static int __myfs_parse_size(size_t *size, const char *str) {
   return 1;
 }
 
+static int __myfs_parse_timeout(double *timeout, const char *str, double def) {
+  double t;
+  char *end;
+
+  if (str == NULL) {
+    *timeout = def;
+    return 1;
+  }
+  if (*str == '\0') return 0;
+  t = strtod(str, &end);
+  if (*end != '\0') return 0;
+  if (!(t >= 0.0)) return 0;
+  *timeout = t;
+  return 1;
+}
+
 static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, struct __myfs_options_struct_t *opts) {
   int size_specified, using_backup;
   size_t size;
@@ -115,6 +254,37 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
   size_t len;
   size_t orig_size;
 
+  /* Handle kernel caching */
+  if (!(__myfs_parse_timeout(&env->entry_timeout, opts->entry_timeout, MYFS_DEFAULT_ENTRY_TIMEOUT) &&
+        __myfs_parse_timeout(&env->attr_timeout, opts->attr_timeout, MYFS_DEFAULT_ATTR_TIMEOUT) &&
+        __myfs_parse_timeout(&env->negative_timeout, opts->negative_timeout, MYFS_DEFAULT_NEGATIVE_TIMEOUT))) {
+    fprintf(stderr, "Cannot parse timeout indication\n");
+    return 0;
+  }
+
+  /* Handle background writeback */
+  env->flush_rate = MYFS_DEFAULT_FLUSH_RATE;
+  if (!(__myfs_parse_timeout(&env->flush_interval, opts->flush_interval, MYFS_DEFAULT_FLUSH_INTERVAL) &&
+        ((opts->flush_rate == NULL) || __myfs_parse_size(&env->flush_rate, opts->flush_rate)))) {
+    fprintf(stderr, "Cannot parse flush indication\n");
+    return 0;
+  }
+  env->flusher_running = 0;
+  env->flusher_stop = 0;
+  if ((pthread_mutex_init(&env->flusher_lock, NULL) != 0) ||
+      (pthread_cond_init(&env->flusher_cond, NULL) != 0)) {
+    fprintf(stderr, "Cannot set up the flusher\n");
+    return 0;
+  }
+  env->kernel_cache = opts->kernel_cache;
+  env->big_writes = opts->big_writes;
+  env->stats = opts->stats;
+  env->atime = opts->noatime ? MYFS_ATIME_NEVER :
+               (opts->relatime ? MYFS_ATIME_RELATIME : MYFS_ATIME_ALWAYS);
+  env->lazytime = opts->lazytime;
+  env->context = NULL;
+  env->chan = NULL;
+
   /* Handle size */
   if (opts->size != NULL) {
     size_specified = 1;
@@ -135,29 +305,17 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     size = MYFS_MIN_SIZE;
   }
 
-  /* Setup lock for the threads */
-  if (pthread_mutex_init(&(env->env_lock), NULL) != 0) {
-    perror("Cannot setup mutex");
-    return 0;    
-  }
-  
   /* Handle backup file */
   if (opts->filename != NULL) {
     using_backup = 1;
     fd = open(opts->filename, O_CREAT | O_RDWR, 00644);
     if (fd < 0) {
       perror("Cannot open backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
       return 0;
     }
     off = lseek(fd, 0, SEEK_END);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
       return 0;
     }
     len = (size_t) off;
@@ -165,9 +323,6 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     off = lseek(fd, 0, SEEK_SET);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
       return 0;
     }
     if (size_specified) {
@@ -184,9 +339,6 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     }
     if (ftruncate(fd, size) != 0) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
       return 0;
     }
   } else {
@@ -203,18 +355,12 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
       if (close(fd) != 0) {
         perror("Cannot close backup-file");
       }
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
       return 0;
     }
   } else {
     memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (memory == MAP_FAILED) {
       perror("Cannot map in memory");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
       return 0;
     }
   }
@@ -241,7 +387,18 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
   return 1;
 }
 
+static void __myfs_stop_flusher(struct __myfs_environment_struct_t *env);
+
 static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
+  int __myfs_errno;
+
+  __myfs_stop_flusher(env);
+  if (env->context != NULL) {
+    if (__myfs_unmount_implem(env->memory, env->size, env->context, &__myfs_errno) < 0) {
+      fprintf(stderr, "Cannot unmount file-system: %s\n", strerror(__myfs_errno));
+    }
+    env->context = NULL;
+  }
   if (env->using_backup) {
     if (msync(env->memory, env->size, MS_SYNC) != 0) {
       perror("Cannot synchronize memory map with backup-file");
@@ -255,34 +412,170 @@ static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
       perror("Cannot close backup-file");
     }
   }
-  if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-    perror("Cannot destroy mutex");
+}
+
+/* Writes one dirty range of the image back, widened to whole pages */
+static int __myfs_msync_range(void *arg, size_t offset, size_t len) {
+  struct __myfs_environment_struct_t *env = (struct __myfs_environment_struct_t *) arg;
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  size_t start, end;
+
+  start = offset - offset % page_size;
+  end = offset + len;
+  end = (end + page_size - 1) - (end + page_size - 1) % page_size;
+  if (end > env->size) end = env->size;
+  return (msync(((char *) env->memory) + start, end - start, MS_SYNC) != 0) ? -1 : 0;
+}
+
+/* Starts writing one range of the image back, widened to whole pages,
+   without waiting for it. msync with MS_ASYNC is a no-op on Linux, where
+   the kernel tracks dirty pages of shared mappings by itself, so the
+   backup-file's pages are pushed with sync_file_range where there is one.
+   An empty range is skipped, sync_file_range reads a length of 0 as up to
+   the end of the file. */
+static int __myfs_writeback_range(void *arg, size_t offset, size_t len) {
+  struct __myfs_environment_struct_t *env = (struct __myfs_environment_struct_t *) arg;
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  size_t start, end;
+
+  if (len == ((size_t) 0)) return 0;
+  start = offset - offset % page_size;
+  end = offset + len;
+  end = (end + page_size - 1) - (end + page_size - 1) % page_size;
+  if (end > env->size) end = env->size;
+  if (end <= start) return 0;
+#ifdef SYNC_FILE_RANGE_WRITE
+  return (sync_file_range(env->backup_fd, (off_t) start, (off_t) (end - start),
+                          SYNC_FILE_RANGE_WRITE) != 0) ? -1 : 0;
+#else
+  return (msync(((char *) env->memory) + start, end - start, MS_ASYNC) != 0) ? -1 : 0;
+#endif
+}
+
+/* Flusher thread: every flush_interval seconds, starts writeback of up to
+   flush_rate times the interval bytes written since the last round. An
+   fsync then mostly waits for pages already on their way, and unmount
+   has at most a few seconds worth of writes left to sync. */
+static void *__myfs_flusher(void *arg) {
+  struct __myfs_environment_struct_t *env = (struct __myfs_environment_struct_t *) arg;
+  struct timespec deadline;
+  double budget;
+  size_t max_bytes;
+  int __myfs_errno;
+
+  budget = ((double) env->flush_rate) * env->flush_interval;
+  max_bytes = ((env->flush_rate == ((size_t) 0)) || (budget >= (double) SIZE_MAX)) ?
+              SIZE_MAX : (size_t) budget;
+  if (max_bytes == ((size_t) 0)) max_bytes = (size_t) 1;
+
+  pthread_mutex_lock(&env->flusher_lock);
+  while (!env->flusher_stop) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t) env->flush_interval;
+    deadline.tv_nsec += (long) ((env->flush_interval - (double) ((time_t) env->flush_interval)) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!env->flusher_stop &&
+           pthread_cond_timedwait(&env->flusher_cond, &env->flusher_lock, &deadline) != ETIMEDOUT);
+    if (env->flusher_stop) break;
+
+    /* A failed round is retried by the next one, fsync reports errors */
+    pthread_mutex_unlock(&env->flusher_lock);
+    __myfs_writeback_implem(env->memory, env->size, env->context, &__myfs_errno, max_bytes,
+                            __myfs_writeback_range, env);
+    pthread_mutex_lock(&env->flusher_lock);
   }
+  pthread_mutex_unlock(&env->flusher_lock);
+  return NULL;
 }
 
-static int __myfs_sync_environment(struct __myfs_environment_struct_t *env) {
+/* Starts the flusher from the init callback of either frontend. Threads
+   don't survive the fork of fuse_daemonize, which comes before init. */
+static void __myfs_start_flusher(struct __myfs_environment_struct_t *env) {
+  if (!(env->using_backup) || !(env->flush_interval > 0.0) || env->flusher_running) return;
+  env->flusher_stop = 0;
+  if (pthread_create(&env->flusher, NULL, __myfs_flusher, env) != 0) {
+    fprintf(stderr, "Cannot start the flusher, writeback is left to fsync and the kernel\n");
+    return;
+  }
+  env->flusher_running = 1;
+}
+
+/* Stops the flusher, waiting for a round in progress */
+static void __myfs_stop_flusher(struct __myfs_environment_struct_t *env) {
+  if (!(env->flusher_running)) return;
+  pthread_mutex_lock(&env->flusher_lock);
+  env->flusher_stop = 1;
+  pthread_cond_signal(&env->flusher_cond);
+  pthread_mutex_unlock(&env->flusher_lock);
+  pthread_join(env->flusher, NULL);
+  env->flusher_running = 0;
+}
+
+/* Syncs the node with inode number ino to the backup-file, or the whole
+   file-system for ino 0. Only blocks written since their last sync are
+   passed to msync, which also syncs the file's data for the range. For a
+   node, its metadata goes out with the journal. */
+static int __myfs_sync_environment(struct __myfs_environment_struct_t *env, uint64_t ino) {
+  int __myfs_errno;
+
   if (env == NULL) return -1;
   if (!(env->using_backup)) return 0;
-  if (msync(env->memory, env->size, MS_SYNC) != 0) return -1;
-  if (fsync(env->backup_fd) != 0) return -1;
+  /* Access times held back by --lazytime go out with this sync */
+  if (__myfs_flush_times_implem(env->memory, env->size, env->context, &__myfs_errno) < 0) return -1;
+  if (__myfs_sync_implem(env->memory, env->size, env->context, &__myfs_errno, ino,
+                         __myfs_msync_range, env) < 0) return -1;
+  if (ino == 0 && fsync(env->backup_fd) != 0) return -1;
   return 0;
 }
 
-/* Declaration for the implementations of the operations */
+/* Counters that tell whether the caches are sized right */
+static void __myfs_print_stats(struct __myfs_environment_struct_t *env) {
+  uint64_t hits, negative_hits, misses;
+  int __myfs_errno;
+
+  if (__myfs_dcache_stats_implem(env->memory, env->size, env->context, &__myfs_errno, &hits, &negative_hits, &misses) < 0)
+    return;
+  fprintf(stderr, "Dentry cache: %llu hits (%llu negative), %llu misses\n",
+          (unsigned long long) hits, (unsigned long long) negative_hits,
+          (unsigned long long) misses);
+}
+
+/* Runs of the image as a FUSE buffer vector, which is freed with free */
+static struct fuse_bufvec *__myfs_runs_to_bufvec(const struct iovec *iov, int count) {
+  struct fuse_bufvec *bufv;
+  int i;
+
+  bufv = malloc(sizeof(struct fuse_bufvec) + ((size_t) count) * sizeof(struct fuse_buf));
+  if (bufv == NULL) return NULL;
+  bufv->count = (size_t) count;
+  bufv->idx = 0;
+  bufv->off = 0;
+  for (i=0;i<count;i++) {
+    bufv->buf[i].size = iov[i].iov_len;
+    bufv->buf[i].flags = (enum fuse_buf_flags) 0;
+    bufv->buf[i].mem = iov[i].iov_base;
+    bufv->buf[i].fd = -1;
+    bufv->buf[i].pos = 0;
+  }
+  return bufv;
+}
 
-int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
-int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
-int __myfs_mknod_implem(void *, size_t, int *, const char *);
-int __myfs_unlink_implem(void *, size_t, int *, const char *);
-int __myfs_mkdir_implem(void *, size_t, int *, const char *);
-int __myfs_rmdir_implem(void *, size_t, int *, const char *);
-int __myfs_rename_implem(void *, size_t, int *, const char *, const char*);
-int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
-int __myfs_open_implem(void *, size_t, int *, const char *);
-int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
-int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
-int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
-int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
+/* Fill runs of the image from the FUSE buffer vector arg. When the
+   kernel spliced the request into a pipe, this reads from the pipe
+   straight into the image. */
+static ssize_t __myfs_fill_runs(void *arg, const struct iovec *iov, int count) {
+  struct fuse_bufvec *dst;
+  ssize_t res;
+
+  dst = __myfs_runs_to_bufvec(iov, count);
+  if (dst == NULL) return -ENOMEM;
+  res = fuse_buf_copy(dst, (struct fuse_bufvec *) arg, (enum fuse_buf_copy_flags) 0);
+  free(dst);
+  return res;
+}
 
 /* End of declarations */
 
@@ -299,62 +592,72 @@ static int __myfs_getattr(const char *path, struct stat *st) {
   memset(st, 0, sizeof(struct stat));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_getattr_implem(env->memory,
                               env->size,
+                              env->context,
                               &__myfs_errno,
                               env->uid,
                               env->gid,
                               path,
                               st);
-  pthread_mutex_unlock(&(env->env_lock));  
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
+/* Called instead of getattr for open files, e.g. right after create */
+static int __myfs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  if ((fi == NULL) || (fi->fh == 0))
+    return __myfs_getattr(path, st);
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  memset(st, 0, sizeof(struct stat));
+  
+  __myfs_errno = ENOENT;
+  res = __myfs_getattr_ino_implem(env->memory,
+                                  env->size,
+                                  env->context,
+                                  &__myfs_errno,
+                                  env->uid,
+                                  env->gid,
+                                  fi->fh,
+                                  st);
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+/* Entries go straight from the directory's blocks into filler, each with
+   the offset to resume behind it, so a listing bigger than the kernel's
+   buffer is paged over several calls with nothing allocated */
 static int __myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
-  int __myfs_errno, res, i;
-  char **names;
+  int __myfs_errno, res;
   
-  (void) offset;
   (void) fi;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
 
-  names = NULL;
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_readdir_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              path,
-                              &names);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0) {
-    if (res == 0) {
-      filler(buf, ".", NULL, 0);
-      filler(buf, "..", NULL, 0);
-      return 0;
-    } else {
-      if (names != NULL) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-        for (i=0;i<res;i++) {
-          filler(buf, names[i], NULL, 0);
-          free(names[i]);
-        }
-        free(names);
-        return 0;
-      } else {
-        return -ENOENT;
-      }
-    }
-  }
+  res = __myfs_readdir_stream_implem(env->memory,
+                                     env->size,
+                                     env->context,
+                                     &__myfs_errno,
+                                     path,
+                                     offset,
+                                     filler,
+                                     buf);
+  if (res >= 0)
+    return 0;
   return -__myfs_errno;
 }
 
@@ -371,12 +674,11 @@ static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_mknod_implem(env->memory,
                             env->size,
+                            env->context,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -391,12 +693,11 @@ static int __myfs_unlink(const char* path) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_unlink_implem(env->memory,
                              env->size,
+                             env->context,
                              &__myfs_errno,
                              path);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -411,12 +712,11 @@ static int __myfs_mkdir(const char* path, mode_t mode) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_mkdir_implem(env->memory,
                             env->size,
+                            env->context,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -431,12 +731,11 @@ static int __myfs_rmdir(const char* path) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_rmdir_implem(env->memory,
                             env->size,
+                            env->context,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -451,13 +750,12 @@ static int __myfs_rename(const char* from, const char* to) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_rename_implem(env->memory,
                              env->size,
+                             env->context,
                              &__myfs_errno,
                              from,
                              to);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -472,13 +770,12 @@ static int __myfs_truncate(const char* path, off_t size) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_truncate_implem(env->memory,
                                env->size,
+                               env->context,
                                &__myfs_errno,
                                path,
                                size);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -488,6 +785,7 @@ static int __myfs_open(const char* path, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t ino;
 
   if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
         ((fi->flags & O_ACCMODE) == O_WRONLY) ||
@@ -497,38 +795,107 @@ static int __myfs_open(const char* path, struct fuse_file_info* fi) {
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  /* Remember the node, so read and write need not find it again */
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_open_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
+  res = __myfs_open_fh_implem(env->memory,
+                              env->size,
+                              env->context,
+                              &__myfs_errno,
+                              path,
+                              &ino);
+  if (res >= 0) {
+    fi->fh = ino;
     return res;
+  }
   return -__myfs_errno;
 }
 
-static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+/* Creates and opens a file in one call, instead of mknod, getattr and
+   open each looking the path up */
+static int __myfs_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct stat stbuf;
   int __myfs_errno, res;
+  uint64_t ino;
 
-  (void) fi;
+  if (!S_ISREG(mode)) return -EPERM;
+  if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
+        ((fi->flags & O_ACCMODE) == O_WRONLY) ||
+        ((fi->flags & O_ACCMODE) == O_RDWR))) return -EINVAL;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  __myfs_errno = ENOENT;
+  res = __myfs_create_implem(env->memory,
+                             env->size,
+                             env->context,
+                             &__myfs_errno,
+                             path,
+                             &ino);
+
+  /* Someone else created it since the kernel looked. Without O_EXCL
+     that is just an open. */
+  if ((res < 0) && (__myfs_errno == EEXIST) && !(fi->flags & O_EXCL)) {
+    res = __myfs_open_fh_implem(env->memory,
+                                env->size,
+                                env->context,
+                                &__myfs_errno,
+                                path,
+                                &ino);
+    /* Only a regular file can be opened this way */
+    if (res >= 0) {
+      if (__myfs_getattr_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                    context->uid, context->gid, ino, &stbuf) < 0) {
+        res = -1;
+      } else if (!S_ISREG(stbuf.st_mode)) {
+        __myfs_errno = EISDIR;
+        res = -1;
+      }
+    }
+    if ((res >= 0) && (fi->flags & O_TRUNC))
+      res = __myfs_truncate_ino_implem(env->memory,
+                                       env->size,
+                                       env->context,
+                                       &__myfs_errno,
+                                       ino,
+                                       0);
+  }
+  if (res >= 0) {
+    fi->fh = ino;
+    return res;
+  }
+  return -__myfs_errno;
+}
+
+static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_read_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path,
-                           buf,
-                           size,
-                           offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  if ((fi != NULL) && (fi->fh != 0))
+    res = __myfs_read_ino_implem(env->memory,
+                                 env->size,
+                                 env->context,
+                                 &__myfs_errno,
+                                 fi->fh,
+                                 buf,
+                                 size,
+                                 offset);
+  else
+    res = __myfs_read_implem(env->memory,
+                             env->size,
+                             env->context,
+                             &__myfs_errno,
+                             path,
+                             buf,
+                             size,
+                             offset);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -539,21 +906,74 @@ static int __myfs_write(const char* path, const char *buf, size_t size, off_t of
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
 
-  (void) fi;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_write_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path,
-                            buf,
-                            size,
-                            offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  if ((fi != NULL) && (fi->fh != 0))
+    res = __myfs_write_ino_implem(env->memory,
+                                  env->size,
+                                  env->context,
+                                  &__myfs_errno,
+                                  fi->fh,
+                                  buf,
+                                  size,
+                                  offset);
+  else
+    res = __myfs_write_implem(env->memory,
+                              env->size,
+                              env->context,
+                              &__myfs_errno,
+                              path,
+                              buf,
+                              size,
+                              offset);
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+/* Writes on an open file go straight from FUSE's buffer, or the pipe it
+   spliced the request into, to the image. There is no read_buf: the
+   library sends the reply after read_buf returns, when the blocks could
+   already be gone, so reads copy while the file is locked. */
+static int __myfs_write_buf(const char* path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct fuse_bufvec mem;
+  int __myfs_errno, res;
+  ssize_t copied;
+  size_t size;
+
+  size = fuse_buf_size(buf);
+
+  /* Without a handle, go by path through a copy */
+  if ((fi == NULL) || (fi->fh == 0)) {
+    mem = FUSE_BUFVEC_INIT(size);
+    mem.buf[0].mem = malloc(size ? size : 1);
+    if (mem.buf[0].mem == NULL) return -ENOMEM;
+    copied = fuse_buf_copy(&mem, buf, (enum fuse_buf_copy_flags) 0);
+    if (copied >= 0)
+      res = __myfs_write(path, mem.buf[0].mem, (size_t) copied, offset, fi);
+    else
+      res = (int) copied;
+    free(mem.buf[0].mem);
+    return res;
+  }
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  __myfs_errno = ENOENT;
+  res = __myfs_write_runs_ino_implem(env->memory,
+                                     env->size,
+                                     env->context,
+                                     &__myfs_errno,
+                                     fi->fh,
+                                     size,
+                                     offset,
+                                     __myfs_fill_runs,
+                                     buf);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -572,12 +992,11 @@ static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
   memset(stbuf, 0, sizeof(struct statvfs));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_statfs_implem(env->memory,
                              env->size,
+                             env->context,
                              &__myfs_errno,
                              stbuf);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -592,13 +1011,12 @@ static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_utimens_implem(env->memory,
                               env->size,
+                              env->context,
                               &__myfs_errno,
                               path,
                               ts);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -607,34 +1025,73 @@ static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
 static int __myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct stat stbuf;
+  uint64_t ino;
   int __myfs_errno, res;
   
-  (void) path;
   (void) datasync;
-  (void) fi;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  /* Sync just the node, known by its handle or else by its path */
+  ino = (fi != NULL) ? fi->fh : 0;
+  if (ino == 0) {
+    if (__myfs_getattr_implem(env->memory, env->size, env->context, &__myfs_errno,
+                              context->uid, context->gid, path, &stbuf) < 0)
+      return -__myfs_errno;
+    ino = (uint64_t) stbuf.st_ino;
+  }
   
   __myfs_errno = EIO;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_sync_environment(env);
-  pthread_mutex_unlock(&(env->env_lock));
+  res = __myfs_sync_environment(env, ino);
   if (res >= 0)
     return res;
   return -__myfs_errno;  
 }
 
+/* Negotiate the connection with the kernel, for both frontends.
+
+   Without big_writes the kernel sends writes one page at a time, each
+   one a request of its own. With it, the pages of one write(2) come
+   in requests of up to max_write bytes.
+*/
+static void __myfs_init_conn(struct __myfs_environment_struct_t *env, struct fuse_conn_info *conn) {
+  if (env == NULL) return;
+
+  /* Let requests come in, and read replies go out, through pipes, so
+     the data moves between the kernel and the image without a copy in
+     between */
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+  if (env->big_writes && (conn->capable & FUSE_CAP_BIG_WRITES)) {
+    conn->want |= FUSE_CAP_BIG_WRITES;
+    conn->max_write = MYFS_MAX_WRITE;
+  }
+}
+
+static void *__myfs_init(struct fuse_conn_info *conn) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  __myfs_init_conn(env, conn);
+  if (env != NULL) __myfs_start_flusher(env);
+  return env;
+}
+
 static void __myfs_destroy(void *private_data) {
   struct __myfs_environment_struct_t *env;
   
   if (private_data == NULL) return;
   env = (struct __myfs_environment_struct_t *) private_data;
+  if (env->stats) __myfs_print_stats(env);
   __myfs_clear_environment(env);
 }
 
 static struct fuse_operations __myfs_operations = {
   .getattr = __myfs_getattr,
+  .fgetattr = __myfs_fgetattr,
   .readdir = __myfs_readdir,
   .mkdir = __myfs_mkdir,
   .mknod = __myfs_mknod,
@@ -643,21 +1100,605 @@ static struct fuse_operations __myfs_operations = {
   .rename = __myfs_rename,
   .truncate = __myfs_truncate,
   .open = __myfs_open,
+  .create = __myfs_create,
   .read = __myfs_read,
   .write = __myfs_write,
+  .write_buf = __myfs_write_buf,
   .statfs = __myfs_statfs,
   .utimens = __myfs_utimens,
   .fsync = __myfs_fsync,
+  .init = __myfs_init,
   .destroy = __myfs_destroy
 };
 
 /* End of FUSE operations part */
 
+/* Low-level FUSE operations part
+
+   The kernel names nodes by inode number, so lookup searches one
+   directory for one name and every other call goes straight to its
+   node, without walking paths. The inode numbers come from
+   implementation.c as st_ino and are passed back as they are.
+*/
+
+static struct __myfs_environment_struct_t *__myfs_ll_env(fuse_req_t req) {
+  return (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+}
+
+static void __myfs_ll_fill_entry(fuse_req_t req, const struct stat *st, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  e->ino = (fuse_ino_t) st->st_ino;
+  e->generation = (unsigned long) (((uint64_t) st->st_ino) >> 32);
+  e->attr = *st;
+  e->attr_timeout = __myfs_ll_env(req)->attr_timeout;
+  e->entry_timeout = __myfs_ll_env(req)->entry_timeout;
+}
+
+static void __myfs_ll_reply_entry(fuse_req_t req, const struct stat *st) {
+  struct fuse_entry_param e;
+
+  __myfs_ll_fill_entry(req, st, &e);
+  fuse_reply_entry(req, &e);
+}
+
+/* Tell the kernel a node's attributes changed behind a request about
+   another node, e.g. a directory's times and size when an entry is
+   added. Cached pages are left alone: dropping them from inside a
+   request could wait on pages the kernel holds locked for it. */
+static void __myfs_ll_invalidate(fuse_req_t req, fuse_ino_t ino) {
+  struct __myfs_environment_struct_t *env;
+
+  env = __myfs_ll_env(req);
+  if ((env->chan != NULL) && (env->attr_timeout > 0.0))
+    fuse_lowlevel_notify_inval_inode(env->chan, ino, -1, 0);
+}
+
+static void __myfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_entry_param e;
+  struct stat st;
+  int __myfs_errno;
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  if (__myfs_lookup_implem(env->memory, env->size, env->context, &__myfs_errno,
+                           env->uid, env->gid, parent, name, &st) < 0) {
+    if ((__myfs_errno == ENOENT) && (env->negative_timeout > 0.0)) {
+      /* A node id of 0 lets the kernel cache the miss */
+      memset(&e, 0, sizeof(e));
+      e.entry_timeout = env->negative_timeout;
+      fuse_reply_entry(req, &e);
+      return;
+    }
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  __myfs_ll_reply_entry(req, &st);
+}
+
+static void __myfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct stat st;
+  int __myfs_errno;
+
+  (void) fi;
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  if (__myfs_getattr_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                env->uid, env->gid, ino, &st) < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  fuse_reply_attr(req, &st, env->attr_timeout);
+}
+
+static void __myfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                              int to_set, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct timespec ts[2];
+  struct stat st;
+  int __myfs_errno;
+
+  (void) fi;
+
+  /* No chmod nor chown, like the high-level operations */
+  if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+    fuse_reply_err(req, ENOSYS);
+    return;
+  }
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  if (__myfs_getattr_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                env->uid, env->gid, ino, &st) < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    if (__myfs_truncate_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                   ino, attr->st_size) < 0) {
+      fuse_reply_err(req, __myfs_errno);
+      return;
+    }
+  }
+
+  if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+    /* Times that are not set keep their value */
+    ts[0].tv_sec = (to_set & FUSE_SET_ATTR_ATIME) ? attr->st_atime : st.st_atime;
+    ts[1].tv_sec = (to_set & FUSE_SET_ATTR_MTIME) ? attr->st_mtime : st.st_mtime;
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_sec = time(NULL);
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_sec = time(NULL);
+    ts[0].tv_nsec = 0;
+    ts[1].tv_nsec = 0;
+    if (__myfs_utimens_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                  ino, ts) < 0) {
+      fuse_reply_err(req, __myfs_errno);
+      return;
+    }
+  }
+
+  __myfs_ll_getattr(req, ino, NULL);
+}
+
+static void __myfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            mode_t mode, dev_t rdev) {
+  struct __myfs_environment_struct_t *env;
+  struct stat st;
+  int __myfs_errno;
+
+  (void) rdev;
+
+  if (!S_ISREG(mode)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  if (__myfs_mknod_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                              parent, name, &st) < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  __myfs_ll_invalidate(req, parent);
+  __myfs_ll_reply_entry(req, &st);
+}
+
+static void __myfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  struct __myfs_environment_struct_t *env;
+  struct stat st;
+  int __myfs_errno;
+
+  (void) mode;
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  if (__myfs_mkdir_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                              parent, name, &st) < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  __myfs_ll_invalidate(req, parent);
+  __myfs_ll_reply_entry(req, &st);
+}
+
+static void __myfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  res = __myfs_unlink_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                 parent, name);
+  if (res >= 0) __myfs_ll_invalidate(req, parent);
+  fuse_reply_err(req, (res >= 0) ? 0 : __myfs_errno);
+}
+
+static void __myfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  res = __myfs_rmdir_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                parent, name);
+  if (res >= 0) __myfs_ll_invalidate(req, parent);
+  fuse_reply_err(req, (res >= 0) ? 0 : __myfs_errno);
+}
+
+static void __myfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             fuse_ino_t newparent, const char *newname) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  res = __myfs_rename_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                 parent, name, newparent, newname);
+  if (res >= 0) {
+    __myfs_ll_invalidate(req, parent);
+    if (newparent != parent) __myfs_ll_invalidate(req, newparent);
+  }
+  fuse_reply_err(req, (res >= 0) ? 0 : __myfs_errno);
+}
+
+static void __myfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno;
+
+  if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
+        ((fi->flags & O_ACCMODE) == O_WRONLY) ||
+        ((fi->flags & O_ACCMODE) == O_RDWR))) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  if (fi->flags & O_TRUNC) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  if (__myfs_open_keep_ino_implem(env->memory, env->size, env->context, &__myfs_errno, ino) < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+
+  /* Every change to the contents goes through the kernel, which keeps
+     its cached pages up to date, so they stay valid across opens */
+  fi->keep_cache = env->kernel_cache;
+  if (fuse_reply_open(req, fi) != 0) {
+    /* The open was interrupted, no release will come for it */
+    __myfs_release_ino_implem(env->memory, env->size, env->context, &__myfs_errno, ino);
+  }
+}
+
+static void __myfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             mode_t mode, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_entry_param e;
+  struct stat st;
+  int __myfs_errno;
+
+  if (!S_ISREG(mode)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
+        ((fi->flags & O_ACCMODE) == O_WRONLY) ||
+        ((fi->flags & O_ACCMODE) == O_RDWR))) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  if (__myfs_mknod_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                              parent, name, &st) >= 0) {
+    __myfs_ll_invalidate(req, parent);
+  } else if ((__myfs_errno == EEXIST) && !(fi->flags & O_EXCL)) {
+    /* Someone else created it since the kernel looked. Without O_EXCL
+       that is just an open. */
+    if (__myfs_lookup_implem(env->memory, env->size, env->context, &__myfs_errno,
+                             env->uid, env->gid, parent, name, &st) < 0) {
+      fuse_reply_err(req, __myfs_errno);
+      return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      fuse_reply_err(req, EISDIR);
+      return;
+    }
+    if ((fi->flags & O_TRUNC) &&
+        ((__myfs_truncate_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                     st.st_ino, 0) < 0) ||
+         (__myfs_getattr_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                    env->uid, env->gid, st.st_ino, &st) < 0))) {
+      fuse_reply_err(req, __myfs_errno);
+      return;
+    }
+  } else {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+
+  /* Kept like by open, until the kernel releases it */
+  if (__myfs_open_keep_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                  st.st_ino) < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+
+  fi->keep_cache = env->kernel_cache;
+  __myfs_ll_fill_entry(req, &st, &e);
+  if (fuse_reply_create(req, &e, fi) != 0) {
+    __myfs_release_ino_implem(env->memory, env->size, env->context, &__myfs_errno, st.st_ino);
+  }
+}
+
+/* The last descriptor on an open file is closed. A file unlinked while
+   open is freed here. */
+static void __myfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno;
+
+  (void) fi;
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  if (__myfs_release_ino_implem(env->memory, env->size, env->context, &__myfs_errno, ino) < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  fuse_reply_err(req, 0);
+}
+
+struct __myfs_ll_read_struct_t {
+  fuse_req_t req;
+  int        replied;
+};
+
+/* Reply to a read with runs of the image. This happens while the file
+   is locked, so the blocks can't change or be freed before the kernel
+   has the data. */
+static ssize_t __myfs_ll_reply_runs(void *arg, const struct iovec *iov, int count) {
+  struct __myfs_ll_read_struct_t *r;
+  struct fuse_bufvec *bufv;
+  ssize_t size;
+  int res;
+
+  r = (struct __myfs_ll_read_struct_t *) arg;
+  bufv = __myfs_runs_to_bufvec(iov, count);
+  if (bufv == NULL) return -ENOMEM;
+  size = (ssize_t) fuse_buf_size(bufv);
+  res = fuse_reply_data(r->req, bufv, (enum fuse_buf_copy_flags) 0);
+  r->replied = 1;
+  free(bufv);
+  return (res < 0) ? res : size;
+}
+
+static void __myfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_ll_read_struct_t r;
+  int __myfs_errno, res;
+
+  (void) fi;
+
+  env = __myfs_ll_env(req);
+  r.req = req;
+  r.replied = 0;
+  __myfs_errno = ENOENT;
+  res = __myfs_read_runs_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                    ino, size, off, __myfs_ll_reply_runs, &r);
+  if ((res < 0) && !r.replied)
+    fuse_reply_err(req, __myfs_errno);
+}
+
+static void __myfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                                off_t off, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  (void) fi;
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  res = __myfs_write_runs_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                     ino, fuse_buf_size(bufv), off, __myfs_fill_runs, bufv);
+  if (res >= 0)
+    fuse_reply_write(req, res);
+  else
+    fuse_reply_err(req, __myfs_errno);
+}
+
+/* One reply of a streamed listing, filled up to the size the kernel asked for */
+struct __myfs_dirbuf_struct_t {
+  fuse_req_t req;
+  char       *buf;
+  size_t     size;
+  size_t     used;
+};
+
+static int __myfs_ll_dirbuf_add(void *arg, const char *name, const struct stat *st, off_t next) {
+  struct __myfs_dirbuf_struct_t *b;
+  size_t len;
+
+  b = (struct __myfs_dirbuf_struct_t *) arg;
+  len = fuse_add_direntry(b->req, b->buf + b->used, b->size - b->used, name, st, next);
+  if (len > b->size - b->used) return 1;
+  b->used += len;
+  return 0;
+}
+
+static void __myfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct stat st;
+  int __myfs_errno, res;
+
+  env = __myfs_ll_env(req);
+  __myfs_errno = ENOENT;
+  res = __myfs_getattr_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                  0, 0, ino, &st);
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+
+  /* Nothing is kept open, readdir reads the directory at the offset it
+     is given */
+  fuse_reply_open(req, fi);
+}
+
+static void __myfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                              struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_dirbuf_struct_t b;
+  int __myfs_errno, res;
+
+  (void) fi;
+
+  env = __myfs_ll_env(req);
+  b.req = req;
+  b.size = size;
+  b.used = 0;
+  b.buf = malloc(size);
+  if (b.buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  __myfs_errno = ENOENT;
+  res = __myfs_readdir_stream_ino_implem(env->memory, env->size, env->context, &__myfs_errno,
+                                         ino, off, __myfs_ll_dirbuf_add, &b);
+  if (res >= 0)
+    fuse_reply_buf(req, b.buf, b.used);
+  else
+    fuse_reply_err(req, __myfs_errno);
+  free(b.buf);
+}
+
+static void __myfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct __myfs_environment_struct_t *env;
+  struct statvfs stbuf;
+  int __myfs_errno;
+
+  (void) ino;
+
+  env = __myfs_ll_env(req);
+  memset(&stbuf, 0, sizeof(struct statvfs));
+  __myfs_errno = ENOENT;
+  if (__myfs_statfs_implem(env->memory, env->size, env->context, &__myfs_errno, &stbuf) < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  fuse_reply_statfs(req, &stbuf);
+}
+
+static void __myfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  (void) datasync;
+  (void) fi;
+
+  fuse_reply_err(req, (__myfs_sync_environment(__myfs_ll_env(req), ino) >= 0) ? 0 : EIO);
+}
+
+static void __myfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  __myfs_init_conn((struct __myfs_environment_struct_t *) userdata, conn);
+  if (userdata != NULL) __myfs_start_flusher((struct __myfs_environment_struct_t *) userdata);
+}
+
+static struct fuse_lowlevel_ops __myfs_ll_operations = {
+  .init = __myfs_ll_init,
+  .lookup = __myfs_ll_lookup,
+  .getattr = __myfs_ll_getattr,
+  .setattr = __myfs_ll_setattr,
+  .mknod = __myfs_ll_mknod,
+  .mkdir = __myfs_ll_mkdir,
+  .unlink = __myfs_ll_unlink,
+  .rmdir = __myfs_ll_rmdir,
+  .rename = __myfs_ll_rename,
+  .open = __myfs_ll_open,
+  .create = __myfs_ll_create,
+  .release = __myfs_ll_release,
+  .read = __myfs_ll_read,
+  .write_buf = __myfs_ll_write_buf,
+  .fsync = __myfs_ll_fsync,
+  .opendir = __myfs_ll_opendir,
+  .readdir = __myfs_ll_readdir,
+  .statfs = __myfs_ll_statfs
+};
+
+/* Mount and serve the file-system through the low-level operations */
+static int __myfs_lowlevel_main(struct fuse_args *args, struct __myfs_environment_struct_t *env) {
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  char *mountpoint;
+  int multithreaded, foreground, err;
+
+  /* Inode numbers carry a generation in their upper half */
+  if (sizeof(fuse_ino_t) < sizeof(uint64_t)) {
+    fprintf(stderr, "The low-level frontend needs 64-bit inode numbers\n");
+    __myfs_clear_environment(env);
+    return 1;
+  }
+
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+    __myfs_clear_environment(env);
+    return 1;
+  }
+
+  err = -1;
+  ch = fuse_mount(mountpoint, args);
+  if (ch != NULL) {
+    env->chan = ch;
+    se = fuse_lowlevel_new(args, &__myfs_ll_operations, sizeof(__myfs_ll_operations), env);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        if (fuse_daemonize(foreground) != -1) {
+          err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        }
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    env->chan = NULL;
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+  fuse_opt_free_args(args);
+  if (env->stats) __myfs_print_stats(env);
+  __myfs_clear_environment(env);
+  return err ? 1 : 0;
+}
+
+/* End of low-level FUSE operations part */
+
+/* The high-level library caches by its own options. kernel_cache maps
+   to auto_cache, which keeps a file's cached contents only when its
+   modification time and size are unchanged since the last open. */
+static int __myfs_add_cache_args(struct fuse_args *args, struct __myfs_environment_struct_t *env) {
+  char buf[128];
+
+  snprintf(buf, sizeof(buf), "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+           env->entry_timeout, env->attr_timeout, env->negative_timeout);
+  if (fuse_opt_add_arg(args, buf) != 0) return 0;
+  if (env->kernel_cache && (fuse_opt_add_arg(args, "-oauto_cache") != 0)) return 0;
+  return 1;
+}
+
 static void __myfs_show_help(const char *name) {
         printf("usage: %s [options] <mountpoint>\n\n", name);
         printf("File-system specific options:\n"
                "    --backupfile=<s>        File to read file-system content from and save to\n"
                "                            Default: none, all changes are lost\n"
+               "    --entry-timeout=<s>     Seconds the kernel may cache names for\n"
+               "                            Default: 1\n"
+               "    --attr-timeout=<s>      Seconds the kernel may cache attributes for\n"
+               "                            Default: 1\n"
+               "    --negative-timeout=<s>  Seconds the kernel may cache failed lookups for\n"
+               "                            Default: 0\n"
+               "    --flush-interval=<s>    Seconds between background writebacks of the\n"
+               "                            backup-file, 0 for none. Default: 5\n"
+               "    --flush-rate=<s>        Most bytes per second written back in the\n"
+               "                            background, 0 for no limit. Default: 32MB\n"
+               "    --kernel-cache          Keep the kernel's cached file contents when a\n"
+               "                            file that has not changed is opened again\n"
+               "    --big-writes            Let the kernel send writes of up to 128kB at once\n"
+               "                            instead of one page at a time\n"
+               "    --stats                 Print cache hit and miss counters on unmount\n"
+               "    --noatime               Do not update access times on reads\n"
+               "    --relatime              Update access times only when they are older\n"
+               "                            than the last change, or a day old\n"
+               "    --lazytime              Hold access time updates in memory and write\n"
+               "                            them out on fsync and unmount\n"
+               "    --lowlevel              Serve requests through the low-level FUSE API,\n"
+               "                            by inode number instead of by path\n"
                "    --size=<s>              Size of the file system\n"
                "                            Default: 128MB if no backup-file is given.\n"
                "                                     Size of the backup-file otherwise.\n"
@@ -674,10 +1715,23 @@ int main(int argc, char *argv[]) {
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   struct __myfs_environment_struct_t __myfs_environment;
   struct __myfs_environment_struct_t *env_ptr = NULL;
+  int __myfs_errno;
   
   /* Initialize defaults */
   __myfs_options.filename = NULL;
   __myfs_options.size = NULL;
+  __myfs_options.entry_timeout = NULL;
+  __myfs_options.attr_timeout = NULL;
+  __myfs_options.negative_timeout = NULL;
+  __myfs_options.flush_interval = NULL;
+  __myfs_options.flush_rate = NULL;
+  __myfs_options.kernel_cache = 0;
+  __myfs_options.big_writes = 0;
+  __myfs_options.stats = 0;
+  __myfs_options.noatime = 0;
+  __myfs_options.relatime = 0;
+  __myfs_options.lazytime = 0;
+  __myfs_options.lowlevel = 0;
   __myfs_options.show_help = 0;
         
   /* Parse options */
@@ -691,6 +1745,32 @@ int main(int argc, char *argv[]) {
     env_ptr = &__myfs_environment;
     if (!__myfs_setup_environment(env_ptr, &__myfs_options))
       return 1;
+    if (__myfs_mount_implem(env_ptr->memory, env_ptr->size, &env_ptr->context, &__myfs_errno) < 0) {
+      fprintf(stderr, "Cannot mount file-system: %s\n", strerror(__myfs_errno));
+      __myfs_clear_environment(env_ptr);
+      return 1;
+    }
+    if (__myfs_atime_implem(env_ptr->memory, env_ptr->size, env_ptr->context, &__myfs_errno,
+                            env_ptr->atime, env_ptr->lazytime) < 0) {
+      fprintf(stderr, "Cannot set access time updates: %s\n", strerror(__myfs_errno));
+      __myfs_clear_environment(env_ptr);
+      return 1;
+    }
+    /* Only a backup-file is synced, so only then is it worth knowing what
+       to sync, and journaling metadata so fsync doesn't write it in place */
+    if (env_ptr->using_backup &&
+        __myfs_track_dirty_implem(env_ptr->memory, env_ptr->size, env_ptr->context, &__myfs_errno) < 0) {
+      fprintf(stderr, "Cannot track dirty blocks: %s\n", strerror(__myfs_errno));
+      __myfs_clear_environment(env_ptr);
+      return 1;
+    }
+    if (env_ptr->using_backup &&
+        __myfs_journal_implem(env_ptr->memory, env_ptr->size, env_ptr->context, &__myfs_errno,
+                              __myfs_msync_range, env_ptr) < 0) {
+      fprintf(stderr, "Cannot start the journal: %s\n", strerror(__myfs_errno));
+      __myfs_clear_environment(env_ptr);
+      return 1;
+    }
   } else {
     /* Handle displaying of help text */
     __myfs_show_help(argv[0]);
@@ -698,5 +1778,13 @@ int main(int argc, char *argv[]) {
     args.argv[0] = (char*) "";
   }
   
+  if (env_ptr != NULL && __myfs_options.lowlevel)
+    return __myfs_lowlevel_main(&args, env_ptr);
+
+  if (env_ptr != NULL && !__myfs_add_cache_args(&args, env_ptr)) {
+    __myfs_clear_environment(env_ptr);
+    return 1;
+  }
+  
   return fuse_main(args.argc, args.argv, &__myfs_operations, env_ptr);
 }
\ No newline at end of file